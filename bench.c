@@ -0,0 +1,551 @@
+/* Benchmarks of Rover internals, run without a terminal.
+
+   rover.c is included with its main() renamed, so what is measured is the
+   code built into rover itself. Synthetic trees are generated under the
+   given directory on first use, always with the same names and contents,
+   and results are printed on stdout as JSON. */
+
+#define main rover_main
+#include "rover.c"
+#undef main
+
+/* Bump whenever the generated trees change, so old ones are rebuilt. */
+#define BENCH_TREES     2
+
+/* Size of the virtual terminal used to draw listings. */
+#define BENCH_LINES     300
+#define BENCH_COLS      200
+
+/* Number of files and size of each one in the "huge" tree. */
+#define HUGE_FILES      4
+#define HUGE_SIZE       (64 * 1024 * 1024)
+
+typedef void (*GEN)(int dirfd);
+
+typedef struct Tree {
+    const char *name;
+    GEN gen;
+    int large; /* Only with -l. */
+} Tree;
+
+static unsigned long long seed;
+static int nresults;
+
+/* Pseudo-random numbers, the same on every run. */
+static unsigned
+rnd()
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+}
+
+static double
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+dblcmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Print the timings of a benchmark as a JSON object. */
+static void
+report(const char *bench, const char *tree, long items, const char *unit,
+       int errors, double *times, int reps)
+{
+    qsort(times, reps, sizeof *times, dblcmp);
+    printf("%s\n    {\"bench\": \"%s\", \"tree\": \"%s\", \"items\": %ld, "
+           "\"unit\": \"%s\", \"errors\": %d, \"reps\": %d, "
+           "\"min_ms\": %.3f, \"median_ms\": %.3f}", nresults++ ? "," : "",
+           bench, tree, items, unit, errors, reps, times[0], times[reps / 2]);
+    fflush(stdout);
+}
+
+static void
+write_file(int dirfd, const char *name, off_t size)
+{
+    static char buf[64 * 1024];
+    size_t i;
+    ssize_t n;
+    int fd;
+
+    if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        return;
+    while (size > 0) {
+        for (i = 0; i < sizeof buf; i += 4)
+            *(unsigned *) (buf + i) = rnd();
+        n = write(fd, buf, MIN(size, (off_t) sizeof buf));
+        if (n <= 0)
+            break;
+        size -= n;
+    }
+    close(fd);
+}
+
+static int
+make_dir(int dirfd, const char *name)
+{
+    mkdirat(dirfd, name, 0755);
+    return openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+}
+
+/* Wide directory of empty files in no particular order, one in ten being
+   a directory. */
+static void
+gen_flat(int dirfd, int n)
+{
+    char name[32];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof name, "%08x-%d", rnd(), i);
+        if (i % 10)
+            write_file(dirfd, name, 0);
+        else
+            mkdirat(dirfd, name, 0755);
+    }
+}
+
+static void gen_flat10k(int dirfd) { gen_flat(dirfd, 10000); }
+static void gen_flat100k(int dirfd) { gen_flat(dirfd, 100000); }
+/* Just past the size of listings kept in an on-disk index. */
+static void gen_flat1m(int dirfd) { gen_flat(dirfd, RV_INDEX_THRESH + 1000); }
+
+/* Chain of directories longer than PATH_MAX, with a file at each level. */
+static void
+gen_deep(int dirfd)
+{
+    char name[32];
+    int i, fd;
+
+    dirfd = dup(dirfd);
+    for (i = 0; i < 600 && dirfd != -1; i++) {
+        write_file(dirfd, "file", rnd() % 1024);
+        snprintf(name, sizeof name, "level%04d", i);
+        fd = make_dir(dirfd, name);
+        close(dirfd);
+        dirfd = fd;
+    }
+    if (dirfd != -1)
+        close(dirfd);
+}
+
+/* Many small files spread over a hundred directories. */
+static void
+gen_small(int dirfd)
+{
+    char name[32];
+    int i, j, fd;
+
+    for (i = 0; i < 100; i++) {
+        snprintf(name, sizeof name, "dir%02d", i);
+        if ((fd = make_dir(dirfd, name)) == -1)
+            continue;
+        for (j = 0; j < 200; j++) {
+            snprintf(name, sizeof name, "file%03d.txt", j);
+            write_file(fd, name, rnd() % 4096);
+        }
+        close(fd);
+    }
+}
+
+static void
+gen_huge(int dirfd)
+{
+    char name[32];
+    int i;
+
+    for (i = 0; i < HUGE_FILES; i++) {
+        snprintf(name, sizeof name, "huge%d.bin", i);
+        write_file(dirfd, name, HUGE_SIZE);
+    }
+}
+
+/* Names made of multibyte characters of several scripts. */
+static void
+gen_utf8(int dirfd)
+{
+    static const char *parts[] = {
+        "a", "Z", "\xc3\xa4", "\xc3\x89", "\xc3\x9f", "\xc3\xb8",
+        "\xce\xa9", "\xce\xbb", "\xd0\x96", "\xd1\x8f",
+        "\xe6\x97\xa5", "\xe6\x9c\xac", "\xe3\x81\x82", "\xed\x95\x9c",
+        "\xf0\x9f\x98\x80", "-"
+    };
+    char name[128];
+    int i, j, len;
+
+    for (i = 0; i < 10000; i++) {
+        len = snprintf(name, sizeof name, "%d", i);
+        for (j = 0; j < 6; j++)
+            len += snprintf(name + len, sizeof name - len, "%s",
+                            parts[rnd() % (sizeof parts / sizeof *parts)]);
+        write_file(dirfd, name, 0);
+    }
+}
+
+static const Tree trees[] = {
+    {"flat10k", gen_flat10k, 0},
+    {"flat100k", gen_flat100k, 0},
+    {"flat1m", gen_flat1m, 1},
+    {"deep", gen_deep, 0},
+    {"small", gen_small, 0},
+    {"huge", gen_huge, 0},
+    {"utf8", gen_utf8, 0},
+};
+
+/* Run a batch operation on a single entry of root to completion, the way
+   a job does. Returns the number of errors. */
+static int
+run_bench_job(const char *root, const char *entry, const char *dst,
+              PROCESS pre, PROCESS proc, PROCESS pos,
+              int (*tree)(Job *job, const char *path))
+{
+    Job *job;
+    int nerrors;
+
+    job = calloc(1, sizeof *job);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->resumed);
+    job->pre = pre;
+    job->proc = proc;
+    job->pos = pos;
+    job->tree = tree;
+    snprintf(job->src, PATH_MAX, "%s", root);
+    snprintf(job->dst, PATH_MAX, "%s", dst);
+    job->entries = malloc(sizeof *job->entries);
+    job->entries[0] = arena_strdup(&job->names, entry, 0);
+    job->nentries = 1;
+    run_job(job);
+    nerrors = job->nerrors;
+    free_job(job);
+    return nerrors;
+}
+
+static void
+remove_tree(const char *root, const char *name)
+{
+    char entry[PATH_MAX];
+
+    snprintf(entry, PATH_MAX, "%s/", name);
+    run_bench_job(root, entry, root, NULL, delfile, deldir, delete_tree);
+}
+
+/* Generate the trees that are missing or out of date. */
+static void
+generate(const char *root, int large)
+{
+    char stamp[PATH_MAX];
+    const Tree *tree;
+    int rootfd, fd;
+    FILE *fp;
+    int version;
+
+    mkdir(root, 0755);
+    if ((rootfd = open(root, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "error: cannot open %s\n", root);
+        exit(1);
+    }
+    for (tree = trees; tree < trees + sizeof trees / sizeof *trees; tree++) {
+        if (tree->large && !large)
+            continue;
+        snprintf(stamp, PATH_MAX, "%s%s.stamp", root, tree->name);
+        version = 0;
+        if ((fp = fopen(stamp, "r"))) {
+            if (fscanf(fp, "%d", &version) != 1)
+                version = 0;
+            fclose(fp);
+        }
+        if (version == BENCH_TREES)
+            continue;
+        fprintf(stderr, "generating %s%s\n", root, tree->name);
+        remove_tree(root, tree->name);
+        seed = hash_name(tree->name);
+        if ((fd = make_dir(rootfd, tree->name)) == -1)
+            continue;
+        tree->gen(fd);
+        close(fd);
+        if ((fp = fopen(stamp, "w"))) {
+            fprintf(fp, "%d\n", BENCH_TREES);
+            fclose(fp);
+        }
+    }
+    close(rootfd);
+}
+
+/* List a directory the way rover does in the background, or the entries
+   under it matching a pattern. */
+static Load *
+bench_ls(const char *path, const char *pattern)
+{
+    Load *load;
+
+    load = calloc(1, sizeof *load);
+    if ((load->dirfd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+        free(load);
+        return NULL;
+    }
+    pthread_mutex_init(&load->lock, NULL);
+    pthread_cond_init(&load->cond, NULL);
+    load->refs = 1;
+    load->flags = RV_FLAGS;
+    if (pattern) {
+        load->pattern = strdup(pattern);
+        ls_find(load);
+    } else
+        ls(load);
+    close(load->dirfd);
+    return load;
+}
+
+/* Listing, sorting, searching and drawing of a wide directory. */
+static void
+bench_listing(const char *root, const char *name, int reps, SCREEN *screen)
+{
+    char path[PATH_MAX];
+    double times[reps];
+    Load *load = NULL;
+    Row *rows;
+    int i, j, n, found = 0;
+
+    snprintf(path, PATH_MAX, "%s%s/", root, name);
+    for (i = 0; i < reps; i++) {
+        times[i] = now_ms();
+        load = bench_ls(path, NULL);
+        times[i] = now_ms() - times[i];
+        if (!load)
+            return;
+        if (i < reps - 1)
+            release_load(load);
+    }
+    strcpy(CWD, path);
+    if (load->index.map) {
+        /* Runs were sorted while listing; there's nothing left to sort. */
+        n = load->nindex;
+        report("ls_index", name, n, "entries", 0, times, reps);
+        take_index(&load->index, n);
+        memset(&load->index, 0, sizeof load->index);
+        goto search;
+    }
+    n = load->nrows;
+    report("ls", name, n, "entries", 0, times, reps);
+
+    rows = malloc(n * sizeof *rows);
+    for (i = 0; i < reps; i++) {
+        memcpy(rows, load->rows, n * sizeof *rows);
+        seed = i;
+        for (j = n - 1; j > 0; j--) {
+            Row row = rows[j];
+            int k = rnd() % (j + 1);
+            rows[j] = rows[k];
+            rows[k] = row;
+        }
+        times[i] = now_ms();
+        sort_rows(rows, n);
+        times[i] = now_ms() - times[i];
+    }
+    free(rows);
+    report("sort", name, n, "entries", 0, times, reps);
+
+    merge_listing(load->rows, n, &load->names);
+    load->rows = NULL;
+    load->nrows = 0;
+search:
+    for (i = 0; i < reps; i++) {
+        rover.gen++;
+        found = 0;
+        times[i] = now_ms();
+        build_search();
+        for (j = 0; j < n; j += MAX(n / 10000, 1))
+            found += search_exact(ENAME(j)) == j;
+        times[i] = now_ms() - times[i];
+    }
+    j = n / MAX(n / 10000, 1);
+    report("search", name, j, "lookups", j - found, times, reps);
+
+    if (screen) {
+        for (i = 0; i < reps; i++) {
+            ESEL = SCROLL = 0;
+            times[i] = now_ms();
+            for (j = 0; j < 100; j++) {
+                rover.drawn.valid = 0;
+                update_view();
+            }
+            times[i] = now_ms() - times[i];
+        }
+        report("update_view", name, 100, "draws", 0, times, reps);
+        for (i = 0; i < reps; i++) {
+            ESEL = SCROLL = 0;
+            update_view();
+            times[i] = now_ms();
+            for (j = 0; j < 1000; j++) {
+                ESEL = MIN(ESEL + 1, rover.nfiles - 1);
+                update_cursor();
+            }
+            times[i] = now_ms() - times[i];
+        }
+        report("update_cursor", name, 1000, "keys", 0, times, reps);
+    }
+    free_listing(&rover.list);
+    rover.nfiles = 0;
+    rover.gen++;
+    release_load(load);
+}
+
+/* Counting walk, copy and delete of a whole tree. */
+static void
+bench_tree(const char *root, const char *name, int reps)
+{
+    char out[PATH_MAX], entry[PATH_MAX];
+    double times[reps];
+    char *names[1];
+    Load *load;
+    Count count;
+    off_t total = 0;
+    int i, n = 0, errors;
+
+    snprintf(entry, PATH_MAX, "%s/", name);
+    names[0] = entry;
+    for (i = 0; i < reps; i++) {
+        times[i] = now_ms();
+        start_count(&count, root, names, 1);
+        if (count.started)
+            pthread_join(count.thread, NULL);
+        count.started = 0;
+        total = count.total;
+        finish_count(&count);
+        times[i] = now_ms() - times[i];
+    }
+    report("count", name, total, "bytes", 0, times, reps);
+
+    snprintf(out, PATH_MAX, "%s%s/", root, name);
+    for (i = 0; i < reps; i++) {
+        times[i] = now_ms();
+        if (!(load = bench_ls(out, "*1*")))
+            return;
+        n = load->nrows;
+        release_load(load);
+        times[i] = now_ms() - times[i];
+    }
+    report("find", name, n, "matches", 0, times, reps);
+
+    snprintf(out, PATH_MAX, "%sout/", root);
+    remove_tree(root, "out");
+    mkdir(out, 0755);
+    reps = MIN(reps, 3);
+    for (i = errors = 0; i < reps; i++) {
+        times[i] = now_ms();
+        errors += run_bench_job(root, entry, out, adddir, cpyfile, NULL, NULL);
+        times[i] = now_ms() - times[i];
+        if (i < reps - 1)
+            remove_tree(out, name);
+    }
+    report("copy", name, total, "bytes", errors, times, reps);
+
+    for (i = errors = 0; i < reps; i++) {
+        if (i)
+            errors += run_bench_job(root, entry, out, adddir, cpyfile, NULL,
+                                    NULL);
+        times[i] = now_ms();
+        errors += run_bench_job(out, entry, out, NULL, delfile, deldir,
+                                delete_tree);
+        times[i] = now_ms() - times[i];
+    }
+    report("delete", name, total, "bytes", errors, times, reps);
+    rmdir(out);
+}
+
+/* Set up curses on a virtual terminal whose output is thrown away. */
+static SCREEN *
+virtual_screen()
+{
+    SCREEN *screen;
+    FILE *out, *in;
+
+    if (!(out = fopen("/dev/null", "w")) || !(in = fopen("/dev/null", "r")))
+        return NULL;
+    if (!(screen = newterm(getenv("TERM") ? NULL : "xterm", out, in)) &&
+        !(screen = newterm("xterm", out, in)))
+        return NULL;
+    resize_term(BENCH_LINES, BENCH_COLS);
+    if (has_colors()) {
+        start_color();
+        init_pair(RED, COLOR_RED, COLOR_BLACK);
+        init_pair(GREEN, COLOR_GREEN, COLOR_BLACK);
+        init_pair(YELLOW, COLOR_YELLOW, COLOR_BLACK);
+        init_pair(BLUE, COLOR_BLUE, COLOR_BLACK);
+        init_pair(CYAN, COLOR_CYAN, COLOR_BLACK);
+        init_pair(MAGENTA, COLOR_MAGENTA, COLOR_BLACK);
+        init_pair(WHITE, COLOR_WHITE, COLOR_BLACK);
+        init_pair(BLACK, COLOR_BLACK, COLOR_BLACK);
+    }
+    rover.window = subwin(stdscr, LINES - 2, COLS, 1, 0);
+    idlok(rover.window, TRUE);
+    return screen;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char root[PATH_MAX];
+    const Tree *tree;
+    const char *collate;
+    SCREEN *screen;
+    int i, large, reps;
+
+    large = 0;
+    reps = 5;
+    for (i = 1; i < argc - 1; i++)
+        if (!strcmp(argv[i], "-l"))
+            large = 1;
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc - 1)
+            reps = atoi(argv[++i]);
+        else
+            break;
+    if (i != argc - 1 || reps < 1) {
+        fprintf(stderr, "Usage: %s [-l] [-r REPS] DIR\n"
+                "       Generate test trees in DIR if needed and benchmark "
+                "rover on them.\n"
+                "  -l   Include the tree with over a million entries, listed\n"
+                "       through an on-disk index.\n", argv[0]);
+        return 1;
+    }
+    snprintf(root, PATH_MAX - 1, "%s", argv[i]);
+    if (root[strlen(root) - 1] != '/')
+        strcat(root, "/");
+    setlocale(LC_ALL, "");
+    collate = setlocale(LC_COLLATE, NULL);
+    bytecmp = !strcmp(collate, "C") || !strcmp(collate, "POSIX") ||
+              !strncmp(collate, "C.", 2);
+    rover.tabs[0].flags = RV_FLAGS;
+    rover.inotify_fd = rover.watch = -1;
+    init_marks(&rover.marks);
+    generate(root, large);
+    screen = virtual_screen();
+    printf("{\"version\": \"%s\", \"locale\": \"%s\", \"results\": [",
+           RV_VERSION, collate);
+    for (tree = trees; tree < trees + sizeof trees / sizeof *trees; tree++) {
+        if (tree->large && !large)
+            continue;
+        if (!strncmp(tree->name, "flat", 4) || !strcmp(tree->name, "utf8"))
+            bench_listing(root, tree->name, reps, screen);
+        else
+            bench_tree(root, tree->name, reps);
+    }
+    printf("\n]}\n");
+    if (screen) {
+        endwin();
+        delscreen(screen);
+    }
+    free_marks(&rover.marks);
+    return 0;
+}
@@ -22,9 +22,14 @@
 #define RVK_EDIT        "e"
 #define RVK_OPEN        "o"
 #define RVK_SEARCH      "/"
+#define RVK_FIND        "F"
+#define RVK_GREP        "c"
 #define RVK_TG_FILES    "f"
 #define RVK_TG_DIRS     "d"
 #define RVK_TG_HIDDEN   "s"
+#define RVK_TG_SIZES    "z"
+#define RVK_TG_SORT     "S"
+#define RVK_TG_PROFILE  "^P"
 #define RVK_NEW_FILE    "n"
 #define RVK_NEW_DIR     "N"
 #define RVK_RENAME      "R"
@@ -36,6 +41,9 @@
 #define RVK_MARK_DELETE "X"
 #define RVK_MARK_COPY   "C"
 #define RVK_MARK_MOVE   "V"
+#define RVK_JOBS        "w"
+#define RVK_JOB_PAUSE   "p"
+#define RVK_JOB_CANCEL  "x"
 
 /* Colors available: DEFAULT, RED, GREEN, YELLOW, BLUE, CYAN, MAGENTA, WHITE, BLACK. */
 #define RVC_CWD         GREEN
@@ -62,6 +70,8 @@
 /* Prompt strings for line input. */
 #define RV_PROMPT(S)    S ": "
 #define RVP_SEARCH      RV_PROMPT("search")
+#define RVP_FIND        RV_PROMPT("find")
+#define RVP_GREP        RV_PROMPT("grep")
 #define RVP_NEW_FILE    RV_PROMPT("new file")
 #define RVP_NEW_DIR     RV_PROMPT("new dir")
 #define RVP_RENAME      RV_PROMPT("rename")
@@ -69,8 +79,43 @@
 /* Number of entries to jump on RVK_JUMP_DOWN and RVK_JUMP_UP. */
 #define RV_JUMP         10
 
+/* Number of threads used to stat() and sort entries of large directories.
+   Set it to 1 to do everything on the main thread. */
+#define RV_STAT_THREADS 8
+
+/* Number of threads used to compute the sizes of directories. */
+#define RV_SIZE_THREADS 4
+
+/* Number of threads used to delete each marked directory tree. */
+#define RV_DELETE_THREADS 8
+
+/* Number of threads used to walk the tree searched by RVK_FIND, or to read
+   the files searched by RVK_GREP. */
+#define RV_FIND_THREADS 8
+
+/* Maximum number of batch operations (copy, move, delete) running at once.
+   Further ones wait in the job list. */
+#define RV_JOBS_MAX     2
+
+/* Memory budget, in bytes, for listings kept to make revisits instant. */
+#define RV_CACHE_SIZE   (64 * 1024 * 1024)
+
+/* Milliseconds the cursor must rest on a directory before its listing, and
+   the one of the parent directory, are loaded in the background into the
+   cache above, so that entering them is instant. At most RV_PREFETCHES are
+   loaded at once, each given up past a quarter of RV_CACHE_SIZE.
+   Set RV_PREFETCH_DELAY to 0 to disable prefetching. */
+#define RV_PREFETCH_DELAY 300
+#define RV_PREFETCHES   2
+
+/* Directories with more entries than this are listed through a sorted index
+   in a temporary file (in $TMPDIR, or /tmp), of which only the parts in use
+   are read into memory. Such listings are sorted in byte order, whatever the
+   locale, and only new sizes and permissions show up without a reload. */
+#define RV_INDEX_THRESH 1000000
+
 /* Default listing view flags.
-   May include SHOW_FILES, SHOW_DIRS and SHOW_HIDDEN. */
+   May include SHOW_FILES, SHOW_DIRS, SHOW_HIDDEN, SHOW_SIZES and SORT_SIZE. */
 #define RV_FLAGS        SHOW_FILES | SHOW_DIRS
 
 /* Optional macro to be executed when a batch operation finishes. */
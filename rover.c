@@ -1,6 +1,9 @@
 #ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE       700
 #endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE         /* syscall(), d_type, ... */
+#endif
 #define _XOPEN_SOURCE_EXTENDED
 #define _FILE_OFFSET_BITS   64
 
@@ -17,13 +20,24 @@
 #include <unistd.h>     /* chdir(), getcwd(), read(), close(), ... */
 #include <dirent.h>     /* DIR, struct dirent, opendir(), ... */
 #include <libgen.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
 #include <fcntl.h>      /* open() */
 #include <sys/wait.h>   /* waitpid() */
 #include <signal.h>     /* struct sigaction, sigaction() */
 #include <errno.h>
 #include <stdarg.h>
+#include <time.h>       /* clock_gettime() */
+#include <sys/mman.h>   /* mmap() */
+#include <pthread.h>
 #include <curses.h>
+#ifdef __linux__
+#include <sys/syscall.h> /* SYS_getdents64, SYS_copy_file_range */
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>   /* FICLONE */
+#endif
 
 #include "config.h"
 
@@ -47,6 +61,12 @@ static char *user_pager;
 static char *user_editor;
 static char *user_open;
 
+/* Whether the collation order of the locale is plain byte order. */
+static int bytecmp;
+
+/* Directory where temporary files go, e.g. on-disk indexes. */
+static const char *tmpdir = "/tmp";
+
 /* Listing view parameters. */
 #define HEIGHT      (LINES-4)
 #define STATUSPOS   (COLS-16)
@@ -55,28 +75,275 @@ static char *user_open;
 #define SHOW_FILES      0x01u
 #define SHOW_DIRS       0x02u
 #define SHOW_HIDDEN     0x04u
+#define SHOW_SIZES      0x08u
+#define SORT_SIZE       0x10u
+
+/* Size of the buffer used to read directory entries in bulk. */
+#define DENTS_BUFLEN    (128 * 1024)
+
+/* Number of entries handed to a worker thread at a time. */
+#define STAT_CHUNK      256
+
+/* Listings smaller than this are sorted by a single thread. */
+#define SORT_THRESH     16384
+
+/* First byte of sort keys, to put directories before other entries. */
+#define KEY_DIR         '\1'
+#define KEY_FILE        '\2'
+
+/* Background loading of listings. Rows are handed to the main thread in
+   batches that start at LOAD_BATCH entries and double up to LOAD_BATCH_MAX.
+   cd() waits up to LOAD_WAIT milliseconds for the listing to be complete
+   before showing a partial one. */
+#define LOAD_BATCH      1024
+#define LOAD_BATCH_MAX  65536
+#define LOAD_WAIT       150
+
+/* Matches of a find are published by each thread in batches of up to
+   FIND_BATCH, or after FIND_LATENCY milliseconds. */
+#define FIND_BATCH      4096
+#define FIND_LATENCY    100
+
+/* Files are taken as binary by a grep if one of their first GREP_PROBE
+   bytes is NUL. They are searched GREP_CHUNK bytes at a time, rounded up to
+   whole lines, checking for cancellation in between. */
+#define GREP_PROBE      8192
+#define GREP_CHUNK      (64 * 1024 * 1024)
+
+/* Number of directories listed last that aren't prefetched again. */
+#define PREFETCH_RECENT 8
+
+/* Listings of more than RV_INDEX_THRESH entries are sorted in runs of
+   INDEX_RUN entries, and written through buffers of INDEX_BUFLEN bytes. */
+#define INDEX_RUN       (256 * 1024)
+#define INDEX_BUFLEN    (64 * 1024)
+
+/* File copies are done in ranges of COPY_RANGE bytes, reporting progress
+   after each one. The read()/write() fallback uses a COPY_BUFLEN buffer. */
+#define COPY_RANGE      (16 * 1024 * 1024)
+#define COPY_BUFLEN     (1024 * 1024)
+
+/* Maximum number of directories kept open by a tree walk. Past that, the
+   outermost ones are closed and reopened by path when needed again. */
+#define WALK_FDS        64
+
+/* Size of the hash table of directory listings read ahead by the counting
+   walk of a job, and maximum memory used by those listings. */
+#define COUNT_BUCKETS   4096
+#define COUNT_CACHE_MAX (32 * 1024 * 1024)
 
-/* Marks parameters. */
-#define BULK_INIT   5
+/* Size of the hash table of recursive directory sizes. */
+#define SIZE_BUCKETS    4096
+#define SIZE_BUCKET(DEV, INO) ((unsigned) ((DEV) * 31 + (INO)) % SIZE_BUCKETS)
+
+/* Minimum size of the blocks of an arena. */
+#define ARENA_BLOCK     (64 * 1024)
+
+/* Profiling. Span durations are sorted in PROF_BUCKETS histogram buckets,
+   and at most PROF_SPANS of them are kept for the trace. Threads past the
+   first PROF_THREADS seen share the last trace id. */
+#define PROF_BUCKETS    24
+#define PROF_SPANS      (1 << 20)
+#define PROF_THREADS    64
+
+/* Marks parameters. BULK_INIT must be a power of two. */
+#define BULK_INIT   8
 #define BULK_THRESH 256
 
-/* Information associated to each entry in listing. */
+/* Information associated to each entry of a directory as it's scanned,
+   sorted and loaded. The sort key orders directories first, then entries by
+   name according to the locale. */
 typedef struct Row {
     char *name;
+    char *key;
     off_t size;
     mode_t mode;
     int islink;
     int marked;
 } Row;
 
-/* Dynamic array of marked entries. */
+/* Rows of a listing, stored column by column. Names and sort keys are
+   offsets into a single blob of strings, where a key that is the name
+   after one byte (see KEY_DIR) shares its bytes. Modes are kept whole,
+   permission bits included, in 16 bits. The number of entries is kept
+   along with the listing, e.g. in rover.nfiles. Huge listings have their
+   columns and blob mapped from an on-disk index (see ls_index()). */
+typedef struct Listing {
+    int bulk;
+    uint32_t *names;
+    uint32_t *keys;
+    off_t *sizes;
+    uint16_t *modes;
+    uint8_t *links;
+    uint8_t *marks;
+    char *blob;
+    size_t bloblen;
+    size_t blobbulk;
+    int scattered; /* Whether strings are out of listing order. */
+    size_t dead; /* Bytes of the blob left by removed entries. */
+    char *map; /* Mapping of the index the listing is in, or NULL. */
+    size_t maplen;
+} Listing;
+
+/* Memory taken by an entry of a listing, besides its strings. */
+#define LIST_ENTRY  (2 * sizeof (uint32_t) + sizeof (off_t) + \
+                     sizeof (uint16_t) + 2)
+
+/* Block of memory in an arena. */
+typedef struct Block {
+    struct Block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} Block;
+
+/* Bump allocator for strings that are all freed at once, such as the names
+   of the entries in a listing. New allocations go to the first block. */
+typedef struct Arena {
+    Block *blocks;
+} Arena;
+
+/* Set of marked entries: an open addressing hash table with linear probing,
+   whose names are interned in an arena. Empty slots are NULL. */
 typedef struct Marks {
     char dirpath[PATH_MAX];
     int bulk;
     int nentries;
     char **entries;
+    unsigned *hashes;
+    Arena names;
 } Marks;
 
+/* Identity and version of a listing: the directory it was read from, the
+   modification time of that directory and the view flags used. */
+typedef struct DirKey {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint8_t flags;
+} DirKey;
+
+/* Complete listing kept in memory, in least-recently-used order. */
+typedef struct Cached {
+    DirKey key;
+    int nrows;
+    Listing list;
+    size_t size;
+    struct Cached *prev, *next;
+} Cached;
+
+/* Directory being loaded by a background thread. It's shared by the
+   loader and the main thread, and freed by the last one to release it. */
+typedef struct Load {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    int cancel;
+    int done;
+    int dirfd;
+    uint8_t flags;
+    DirKey key;
+    int cacheable;
+    int error; /* Whether the listing was left incomplete. */
+    int nrows;
+    Row *rows; /* Sorted rows not yet taken by the main thread. */
+    Arena names;
+    int nindex;
+    Listing index; /* Index replacing the rows published so far, if any. */
+    char *path; /* Directory for the loader to open, if not open yet. */
+    char *pattern; /* Names to find under the directory, or NULL. */
+    int grep; /* Whether the pattern is a text to find in files instead. */
+    char *roots; /* Entries to search instead of the directory, as strings
+                    followed by an empty one, or NULL. */
+    size_t budget; /* Memory past which a prefetch gives up, or 0. */
+    size_t used;
+} Load;
+
+/* State of a directory scan. See ls(). */
+typedef struct Scan {
+    Load *load;
+    int dirfd;
+    uint8_t flags;
+    int bytes; /* Whether sort keys are in byte order, whatever the locale. */
+    int nrows;
+    int bulk;
+    Row *rows;
+    Arena names;
+    pthread_mutex_t lock;
+    struct timespec last; /* When a find last published its matches. */
+#ifdef __linux__
+    char *buf;
+#else
+    DIR *dp;
+#endif
+} Scan;
+
+/* Entry of a sorted run written while building an index. It's followed by
+   its sort key and, unless the key is the name after one byte, its name.
+   Entries are padded to keep the next one aligned. */
+typedef struct RunEntry {
+    off_t size;
+    uint16_t mode;
+    uint8_t islink;
+    uint8_t shared; /* Whether the key holds the name. */
+    uint32_t len; /* Length of the whole entry. */
+} RunEntry;
+
+/* Buffered writes to a region of a file, starting at pos. */
+typedef struct Out {
+    int fd;
+    int error;
+    off_t pos;
+    size_t len;
+    char buf[INDEX_BUFLEN];
+} Out;
+
+/* Regions of an index: its columns, widest first to keep them aligned, then
+   the blob. Marks are left as zeros. */
+typedef enum IndexCol {
+    COL_SIZES, COL_NAMES, COL_KEYS, COL_MODES, COL_LINKS, COL_MARKS, COL_BLOB,
+    INDEX_COLS
+} IndexCol;
+
+/* On-disk index being built by ls_index(). Sorted runs are appended to a
+   temporary file, then merged into the regions of another. */
+typedef struct Index {
+    Out runs;
+    off_t *starts; /* Where each run starts, and where the last one ends. */
+    int nruns;
+    int n;
+    size_t bloblen;
+    Out cols[INDEX_COLS];
+} Index;
+
+#ifdef __linux__
+/* Directory entry as returned by getdents64(2). */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/* Index for incremental prefix search over the listing. Each partition
+   of the listing (directories, then files) gets its row indices sorted by
+   name bytes, so that entries with a given prefix are contiguous. In byte
+   order, as in on-disk indexes, this is just the listing order. A stack
+   keeps the range of matches for each prefix of the last searched string. */
+typedef struct Search {
+    int gen;
+    int nrows;
+    int ndirs;
+    int *perm;
+    int *tree; /* Segment tree of smallest row index over ranges of perm. */
+    char prefix[BUFLEN];
+    int depth;
+    int lo[BUFLEN+1][2];
+    int hi[BUFLEN+1][2];
+} Search;
+
 /* Line editing state. */
 typedef struct Edit {
     wchar_t buffer[BUFLEN+1];
@@ -91,33 +358,307 @@ typedef struct Tab {
     char cwd[PATH_MAX];
 } Tab;
 
-typedef struct Prog {
-    off_t partial;
+/* Listing of a directory read ahead by the counting walk of a job, which
+   the processing walk takes instead of reading and stat()ing it again.
+   Each entry is a WalkedEntry followed by its name. */
+typedef struct Walked {
+    struct Walked *next;
+    int refs; /* Walks using it, and the table it's in, if any. */
+    char *path; /* Of the directory, ending in '/'. */
+    char *data;
+    size_t len;
+    size_t bulk;
+} Walked;
+
+typedef struct WalkedEntry {
+    off_t size;
+    mode_t mode;
+} WalkedEntry;
+
+/* Directory on the stack of a tree walk. */
+typedef struct WalkDir {
+    DIR *dp; /* NULL while closed to stay under WALK_FDS. */
+    int dst; /* Matching destination directory, or -1. */
+    size_t len; /* Length of its path, including the final '/'. */
+    Walked *walked; /* Listing read ahead, or NULL to read the directory. */
+    size_t next; /* Offset of the next entry in it. */
+} WalkDir;
+
+/* Iterative walk of a directory tree. Entries are read and stat'ed relative
+   to the descriptor of their directory, and a destination tree can be
+   followed along for operations that mirror the source. */
+typedef struct Walk {
+    WalkDir *dirs;
+    int depth;
+    int bulk;
+    int nopen;
+    int descend; /* Whether the current entry, a directory, is entered. */
+    char **names; /* Entries of the root to walk, or NULL for all. */
+    int nnames;
+    int iname;
+    const char *dst; /* Destination root, ending in '/', or NULL. */
+    char *path; /* Path of the current entry. */
+    size_t pathbulk;
+    const char *name; /* Name of the current entry, inside path. */
+    struct stat st; /* Its lstat() data (WALK_FILE and WALK_DIR). Only the
+                       mode and size are set for entries read ahead. */
+    int stated; /* Whether st is known from the listing read ahead. */
+    int fd; /* Directory containing the current entry. */
+    int dstfd; /* Matching destination directory, or -1. */
+    struct Count *count; /* Where listings read ahead are shared, or NULL. */
+    int ahead; /* Whether directories are read ahead, or else taken. */
+} Walk;
+
+typedef enum WalkEvent {WALK_END, WALK_FILE, WALK_DIR, WALK_POST, WALK_ERROR} WalkEvent;
+
+/* Walk of the marked trees, adding up their sizes in a background thread
+   while a batch operation runs. The operation's own walk takes the listings
+   it read ahead, by path. */
+typedef struct Count {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int started;
+    int cancel;
+    int done;
     off_t total;
-    const char *msg;
-} Prog;
+    const char *root;
+    char **names;
+    int nnames;
+    size_t cached;
+    Walked *walked[COUNT_BUCKETS];
+} Count;
+
+/* Recursive size of a directory, identified by device and inode. */
+typedef struct DirSize {
+    struct DirSize *next;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+} DirSize;
+
+/* Request to compute the size of a directory of the listing. */
+typedef struct SizeJob {
+    struct SizeJob *next;
+    int gen;
+    char *name; /* Name in listing, inside path. */
+    char path[];
+} SizeJob;
+
+/* Pool of threads computing the sizes of the directories in the listing.
+   Jobs are dropped when the listing changes, by increasing gen. */
+typedef struct Sizer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[RV_SIZE_THREADS];
+    int nthreads;
+    int gen;
+    int quit;
+    SizeJob *jobs, *last; /* Queue of pending jobs. */
+    SizeJob *done; /* Jobs done, for the main thread to update rows. */
+    DirSize *sizes[SIZE_BUCKETS];
+} Sizer;
+
+/* Set of inodes with several hard links seen while computing a size. */
+typedef struct Inode {
+    dev_t dev;
+    ino_t ino;
+} Inode;
+
+typedef struct Inodes {
+    size_t count;
+    size_t bulk;
+    Inode *inodes;
+} Inodes;
+
+/* Directory being deleted by delete_tree(). It is removed once its own
+   listing and all its subdirectories are done (pending drops to zero). */
+typedef struct DelNode {
+    struct DelNode *next; /* In the stack of directories to list. */
+    struct DelNode *parent;
+    struct DelNode *link; /* In the list of all nodes, for freeing. */
+    int pending;
+    char path[];
+} DelNode;
+
+/* Directory tree being deleted by a pool of threads. Threads take the
+   directories to list from a shared stack and push the subdirectories
+   they find, so that idle threads pick up pending subtrees. */
+typedef struct DelTree {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[RV_DELETE_THREADS];
+    int nthreads;
+    int waiting; /* Threads waiting for work. */
+    int busy; /* Threads listing a directory. */
+    DelNode *stack;
+    DelNode *nodes;
+    struct Job *job;
+} DelTree;
+
+/* Directory left to read by a find. */
+typedef struct FindDir {
+    struct FindDir *next;
+    char path[]; /* Relative to the root of the find, ending in '/'. */
+} FindDir;
+
+/* Recursive search of a tree for the names matching a pattern, or for the
+   files holding a text (a grep). Threads take the directories to read from
+   a shared stack and push the subdirectories they find, as delete_tree()
+   does. */
+typedef struct Find {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[RV_FIND_THREADS];
+    int nthreads;
+    int waiting;
+    int busy;
+    FindDir *stack;
+    Load *load;
+    int glob; /* Whether the pattern is a glob, or else a substring. */
+    size_t patlen;
+} Find;
+
+typedef enum JobState {
+    JOB_QUEUED, JOB_RUNNING, JOB_PAUSED, JOB_DONE, JOB_FAILED, JOB_CANCELLED
+} JobState;
+
+typedef struct Job Job;
+typedef int (*PROCESS)(Job *job, Walk *walk);
+
+/* Batch operation on a snapshot of the marked entries, run by a thread of
+   its own. Progress and state are protected by the lock. The list of jobs
+   belongs to the main thread. */
+struct Job {
+    Job *next;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int joined;
+    JobState state;
+    int pause;
+    int cancel;
+    int nerrors;
+    int nfiles;
+    off_t bytes;
+    off_t total; /* Total size, once the count is over (see counted). */
+    int counted;
+    double seconds; /* Time spent running, not counting pauses. */
+    struct timespec resumed;
+    PROCESS pre, proc, pos;
+    /* Tries to process a marked entry at once before anything else.
+       Returns 0 if done, or 1 to have it walked instead. */
+    int (*whole)(Job *job, const char *name);
+    /* Processes whole marked directories instead of walking them. */
+    int (*tree)(Job *job, const char *path);
+    mode_t dirmode; /* Permissions of directories made by the job. */
+    FILE *log; /* Where failures are reported, if anywhere. */
+    const char *msg_doing;
+    const char *msg_done;
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    int nentries;
+    char **entries;
+    Arena names;
+    Count count;
+};
+
+/* Operations timed when profiling. */
+typedef enum ProfOp {
+    PROF_CD, PROF_LS, PROF_READDIR, PROF_STAT, PROF_SORT, PROF_VIEW,
+    PROF_CURSOR, PROF_DRAW, PROF_OUTPUT, PROF_JOB, PROF_COPY, PROF_INDEX,
+    PROF_FIND, PROF_NOPS
+} ProfOp;
+
+static const char *prof_names[PROF_NOPS] = {
+    "cd", "ls", "readdir", "stat", "sort", "update_view", "update_cursor",
+    "draw", "output", "job", "copy", "index", "find"
+};
+
+/* Timings of an operation, in nanoseconds. Bucket i of the histogram counts
+   spans shorter than 2^i microseconds, and the last one all the longer. */
+typedef struct ProfStat {
+    unsigned long count;
+    unsigned long syscalls;
+    long long total;
+    long long max;
+    long long last;
+    unsigned long hist[PROF_BUCKETS];
+} ProfStat;
+
+/* Single run of an operation, for the trace. */
+typedef struct ProfSpan {
+    long long start;
+    long long dur;
+    long syscalls;
+    short op;
+    short tid;
+} ProfSpan;
+
+/* Profiling state, shared by all threads and protected by the lock. */
+static struct Profile {
+    const char *path; /* Trace file, or NULL if profiling is off. */
+    pthread_mutex_t lock;
+    struct timespec epoch;
+    ProfStat stats[PROF_NOPS];
+    ProfSpan *spans;
+    int nspans;
+    int bulk;
+    unsigned long dropped;
+    pthread_t threads[PROF_THREADS];
+    int nthreads;
+    int overlay; /* Whether stats are shown on the status line. */
+} profile;
 
 /* Global state. */
 static struct Rover {
     int tab;
     int nfiles;
-    Row *rows;
+    Listing list;
+    int gen; /* Changed whenever rows are added or removed. */
+    Search search;
+    char find[BUFLEN]; /* Pattern of the find listed, or "". */
+    int grep; /* Whether the find looks into the contents of files. */
     WINDOW *window;
     Marks marks;
     Edit edit;
     int edit_scroll;
     volatile sig_atomic_t pending_usr1;
     volatile sig_atomic_t pending_winch;
-    Prog prog;
+    Job *jobs;
+    int show_jobs; /* Whether the job list is shown instead of the listing. */
+    int job_sel;
+    Load *load;
+    Load *prefetches[RV_PREFETCHES];
+    char listed[PREFETCH_RECENT][PATH_MAX];
+    int nlisted;
+    struct {
+        char path[PATH_MAX];
+        struct timespec since;
+    } rest; /* Directory under the cursor, and since when. */
+    Cached *cache;
+    size_t cache_size;
+    int inotify_fd;
+    int watch;
+    Sizer sizer;
+    char target[PATH_MAX];
+    int target_esel;
+    int target_scroll;
+    struct {
+        int valid;
+        int tab, gen, nfiles, esel, scroll;
+        uint32_t *names;
+    } drawn; /* What update_view() last put in the window. */
     Tab tabs[10];
 } rover;
 
 /* Macros for accessing global state. */
-#define ENAME(I)    rover.rows[I].name
-#define ESIZE(I)    rover.rows[I].size
-#define EMODE(I)    rover.rows[I].mode
-#define ISLINK(I)   rover.rows[I].islink
-#define MARKED(I)   rover.rows[I].marked
+#define ENAME(I)    (rover.list.blob + rover.list.names[I])
+#define EKEY(I)     (rover.list.blob + rover.list.keys[I])
+#define ESIZE(I)    rover.list.sizes[I]
+#define EMODE(I)    rover.list.modes[I]
+#define ISLINK(I)   rover.list.links[I]
+#define MARKED(I)   rover.list.marks[I]
 #define SCROLL      rover.tabs[rover.tab].scroll
 #define ESEL        rover.tabs[rover.tab].esel
 #define FLAGS       rover.tabs[rover.tab].flags
@@ -126,7 +667,7 @@ static struct Rover {
 /* Helpers. */
 #define MIN(A, B)   ((A) < (B) ? (A) : (B))
 #define MAX(A, B)   ((A) > (B) ? (A) : (B))
-#define ISDIR(E)    (strchr((E), '/') != NULL)
+#define ISDIR(E)    (*(E) && (E)[strlen(E) - 1] == '/')
 
 /* Line Editing Macros. */
 #define EDIT_FULL(E)       ((E).left == (E).right)
@@ -141,99 +682,17 @@ static struct Rover {
 
 typedef enum EditStat {CONTINUE, CONFIRM, CANCEL} EditStat;
 typedef enum Color {DEFAULT, RED, GREEN, YELLOW, BLUE, CYAN, MAGENTA, WHITE, BLACK} Color;
-typedef int (*PROCESS)(const char *path);
-
-static void
-init_marks(Marks *marks)
-{
-    strcpy(marks->dirpath, "");
-    marks->bulk = BULK_INIT;
-    marks->nentries = 0;
-    marks->entries = calloc(marks->bulk, sizeof *marks->entries);
-}
-
-/* Unmark all entries. */
-static void
-mark_none(Marks *marks)
-{
-    int i;
-
-    strcpy(marks->dirpath, "");
-    for (i = 0; i < marks->bulk && marks->nentries; i++)
-        if (marks->entries[i]) {
-            free(marks->entries[i]);
-            marks->entries[i] = NULL;
-            marks->nentries--;
-        }
-    if (marks->bulk > BULK_THRESH) {
-        /* Reset bulk to free some memory. */
-        free(marks->entries);
-        marks->bulk = BULK_INIT;
-        marks->entries = calloc(marks->bulk, sizeof *marks->entries);
-    }
-}
-
-static void
-add_mark(Marks *marks, char *dirpath, char *entry)
-{
-    int i;
-
-    if (!strcmp(marks->dirpath, dirpath)) {
-        /* Append mark to directory. */
-        if (marks->nentries == marks->bulk) {
-            /* Expand bulk to accomodate new entry. */
-            int extra = marks->bulk / 2;
-            marks->bulk += extra; /* bulk *= 1.5; */
-            marks->entries = realloc(marks->entries,
-                                     marks->bulk * sizeof *marks->entries);
-            memset(&marks->entries[marks->nentries], 0,
-                   extra * sizeof *marks->entries);
-            i = marks->nentries;
-        } else {
-            /* Search for empty slot (there must be one). */
-            for (i = 0; i < marks->bulk; i++)
-                if (!marks->entries[i])
-                    break;
-        }
-    } else {
-        /* Directory changed. Discard old marks. */
-        mark_none(marks);
-        strcpy(marks->dirpath, dirpath);
-        i = 0;
-    }
-    marks->entries[i] = malloc(strlen(entry) + 1);
-    strcpy(marks->entries[i], entry);
-    marks->nentries++;
-}
-
-static void
-del_mark(Marks *marks, char *entry)
-{
-    int i;
-
-    if (marks->nentries > 1) {
-        for (i = 0; i < marks->bulk; i++)
-            if (marks->entries[i] && !strcmp(marks->entries[i], entry))
-                break;
-        free(marks->entries[i]);
-        marks->entries[i] = NULL;
-        marks->nentries--;
-    } else
-        mark_none(marks);
-}
-
-static void
-free_marks(Marks *marks)
-{
-    int i;
+typedef void (*WORK)(void *arg, int first, int last);
 
-    for (i = 0; i < marks->bulk && marks->nentries; i++)
-        if (marks->entries[i]) {
-            free(marks->entries[i]);
-            marks->nentries--;
-        }
-    free(marks->entries);
-}
+/* Range of items shared among threads by run_parallel(). */
+typedef struct Parallel {
+    pthread_mutex_t lock;
+    int next;
+    int count;
+    int chunk;
+    WORK work;
+    void *arg;
+} Parallel;
 
 static void
 handle_usr1(int sig)
@@ -271,15 +730,31 @@ disable_handlers()
 }
 
 static void reload();
+static void reload_changed();
 static void update_view();
+static int sync_load();
+static int sync_watch();
+static int sync_sizes();
+static int sync_jobs();
+static void sync_prefetch();
+static void update_jobs_view();
 
 /* Handle any signals received since last call. */
 static void
 sync_signals()
 {
+    if (sync_load())
+        update_view();
+    if (sync_watch())
+        update_view();
+    if (sync_sizes())
+        update_view();
+    if (sync_jobs())
+        update_view();
+    sync_prefetch();
     if (rover.pending_usr1) {
         /* SIGUSR1 received: refresh directory listing. */
-        reload();
+        reload_changed();
         rover.pending_usr1 = 0;
     }
     if (rover.pending_winch) {
@@ -289,6 +764,7 @@ sync_signals()
         refresh();
         clear();
         rover.window = subwin(stdscr, LINES - 2, COLS, 1, 0);
+        idlok(rover.window, TRUE);
         if (HEIGHT < rover.nfiles && SCROLL + HEIGHT > rover.nfiles)
             SCROLL = ESEL - HEIGHT;
         update_view();
@@ -435,95 +911,220 @@ init_term()
     enable_handlers();
 }
 
-/* Update the listing view. */
+/* Turn profiling on if ROVER_PROFILE is set. */
 static void
-update_view()
+init_profile()
 {
-    int i, j;
-    int numsize;
-    int ishidden;
-    int marking;
+    profile.path = getenv("ROVER_PROFILE");
+    if (profile.path && !profile.path[0])
+        profile.path = NULL;
+    if (!profile.path)
+        return;
+    pthread_mutex_init(&profile.lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &profile.epoch);
+    profile.threads[profile.nthreads++] = pthread_self();
+}
 
-    mvhline(0, 0, ' ', COLS);
-    attr_on(A_BOLD, NULL);
-    color_set(RVC_TABNUM, NULL);
-    mvaddch(0, COLS - 2, rover.tab + '0');
-    attr_off(A_BOLD, NULL);
-    if (rover.marks.nentries) {
-        numsize = snprintf(BUF1, BUFLEN, "%d", rover.marks.nentries);
-        color_set(RVC_MARKS, NULL);
-        mvaddstr(0, COLS - 3 - numsize, BUF1);
-    } else
-        numsize = -1;
-    color_set(RVC_CWD, NULL);
-    mbstowcs(WBUF, CWD, PATH_MAX);
-    mvaddnwstr(0, 0, WBUF, COLS - 4 - numsize);
-    wcolor_set(rover.window, RVC_BORDER, NULL);
-    wborder(rover.window, 0, 0, 0, 0, 0, 0, 0, 0);
-    ESEL = MAX(MIN(ESEL, rover.nfiles - 1), 0);
-    /* Selection might not be visible, due to cursor wrapping or window
-       shrinking. In that case, the scroll must be moved to make it visible. */
-    if (rover.nfiles > HEIGHT) {
-        SCROLL = MAX(MIN(SCROLL, ESEL), ESEL - HEIGHT + 1);
-        SCROLL = MIN(MAX(SCROLL, 0), rover.nfiles - HEIGHT);
+/* Start timing an operation. Returns 0 when not profiling. */
+static long long
+prof_start()
+{
+    struct timespec now;
+
+    if (!profile.path)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return MAX((now.tv_sec - profile.epoch.tv_sec) * 1000000000LL +
+               now.tv_nsec - profile.epoch.tv_nsec, 1);
+}
+
+/* Record an operation started at START that made SYSCALLS system calls. */
+static void
+prof_end(ProfOp op, long long start, long syscalls)
+{
+    ProfStat *stat;
+    ProfSpan *span;
+    pthread_t self;
+    long long dur, us;
+    int i, bucket;
+
+    if (!start)
+        return;
+    dur = prof_start() - start;
+    for (bucket = 0, us = dur / 1000; us && bucket < PROF_BUCKETS - 1; us >>= 1)
+        bucket++;
+    self = pthread_self();
+    pthread_mutex_lock(&profile.lock);
+    stat = &profile.stats[op];
+    stat->count++;
+    stat->syscalls += syscalls;
+    stat->total += dur;
+    stat->max = MAX(stat->max, dur);
+    stat->last = dur;
+    stat->hist[bucket]++;
+    if (profile.nspans == profile.bulk && profile.bulk < PROF_SPANS) {
+        profile.bulk = profile.bulk ? profile.bulk * 2 : 4096;
+        profile.spans = realloc(profile.spans,
+                                profile.bulk * sizeof *profile.spans);
+    }
+    if (profile.nspans < profile.bulk) {
+        for (i = 0; i < profile.nthreads; i++)
+            if (pthread_equal(profile.threads[i], self))
+                break;
+        if (i == profile.nthreads && i < PROF_THREADS)
+            profile.threads[profile.nthreads++] = self;
+        span = &profile.spans[profile.nspans++];
+        span->start = start;
+        span->dur = dur;
+        span->syscalls = syscalls;
+        span->op = op;
+        span->tid = MIN(i, PROF_THREADS - 1);
     } else
-        SCROLL = 0;
-    marking = !strcmp(CWD, rover.marks.dirpath);
-    for (i = 0, j = SCROLL; i < HEIGHT && j < rover.nfiles; i++, j++) {
-        ishidden = ENAME(j)[0] == '.';
-        if (j == ESEL)
-            wattr_on(rover.window, A_REVERSE, NULL);
+        profile.dropped++;
+    pthread_mutex_unlock(&profile.lock);
+}
+
+/* Show the duration of the last run of each operation on the status line. */
+static void
+draw_profile()
+{
+    char buf[256];
+    int op, len;
+
+    len = 0;
+    pthread_mutex_lock(&profile.lock);
+    for (op = 0; op < PROF_NOPS && len < (int) sizeof buf; op++)
+        if (profile.stats[op].count)
+            len += snprintf(buf + len, sizeof buf - len, "%s %.1fms  ",
+                            prof_names[op], profile.stats[op].last / 1e6);
+    pthread_mutex_unlock(&profile.lock);
+    if (!len)
+        strcpy(buf, "nothing timed yet");
+    mvhline(LINES - 1, 0, ' ', STATUSPOS);
+    color_set(RVC_STATUS, NULL);
+    mvaddnstr(LINES - 1, 0, buf, STATUSPOS - 1);
+}
+
+/* Write the recorded spans as a trace in the Chrome trace event format, with
+   the stats of each operation added. */
+static void
+write_profile()
+{
+    FILE *fp;
+    ProfStat *stat;
+    ProfSpan *span;
+    int i, op;
+
+    if (!profile.path || !(fp = fopen(profile.path, "w")))
+        return;
+    fprintf(fp, "{\"traceEvents\": [\n");
+    for (i = 0; i < profile.nthreads; i++)
+        fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                "\"tid\": %d, \"args\": {\"name\": \"%s %d\"}},\n", (int) getpid(),
+                i, i ? "thread" : "main", i);
+    for (i = 0; i < profile.nspans; i++) {
+        span = &profile.spans[i];
+        fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+                "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"syscalls\": %ld}},\n",
+                prof_names[span->op], (int) getpid(), span->tid,
+                span->start / 1e3, span->dur / 1e3, span->syscalls);
+    }
+    fprintf(fp, "{\"name\": \"exit\", \"ph\": \"i\", \"s\": \"g\", \"pid\": %d, "
+            "\"tid\": 0, \"ts\": %.3f}\n], \"displayTimeUnit\": \"ms\",\n"
+            "\"otherData\": {\"version\": \"%s\", \"dropped\": \"%lu\"},\n"
+            "\"stats\": {", (int) getpid(), prof_start() / 1e3, RV_VERSION,
+            profile.dropped);
+    for (op = 0; op < PROF_NOPS; op++) {
+        stat = &profile.stats[op];
+        fprintf(fp, "%s\n\"%s\": {\"count\": %lu, \"syscalls\": %lu, "
+                "\"total_us\": %.3f, \"max_us\": %.3f, \"histogram_us\": [",
+                op ? "," : "", prof_names[op], stat->count, stat->syscalls,
+                stat->total / 1e3, stat->max / 1e3);
+        for (i = 0; i < PROF_BUCKETS; i++)
+            fprintf(fp, "%s%lu", i ? ", " : "", stat->hist[i]);
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "\n}}\n");
+    fclose(fp);
+    free(profile.spans);
+}
+
+/* Draw entry J on its line of the listing window. */
+static void
+draw_row(int j, int marking)
+{
+    int i = j - SCROLL;
+
+    if (j == ESEL)
+        wattr_on(rover.window, A_REVERSE, NULL);
+    if (ISLINK(j))
+        wcolor_set(rover.window, RVC_LINK, NULL);
+    else if (ENAME(j)[0] == '.')
+        wcolor_set(rover.window, RVC_HIDDEN, NULL);
+    else if (S_ISREG(EMODE(j))) {
+        if (EMODE(j) & (S_IXUSR | S_IXGRP | S_IXOTH))
+            wcolor_set(rover.window, RVC_EXEC, NULL);
+        else
+            wcolor_set(rover.window, RVC_REG, NULL);
+    } else if (S_ISDIR(EMODE(j)))
+        wcolor_set(rover.window, RVC_DIR, NULL);
+    else if (S_ISCHR(EMODE(j)))
+        wcolor_set(rover.window, RVC_CHR, NULL);
+    else if (S_ISBLK(EMODE(j)))
+        wcolor_set(rover.window, RVC_BLK, NULL);
+    else if (S_ISFIFO(EMODE(j)))
+        wcolor_set(rover.window, RVC_FIFO, NULL);
+    else if (S_ISSOCK(EMODE(j)))
+        wcolor_set(rover.window, RVC_SOCK, NULL);
+    if (S_ISDIR(EMODE(j)) && !(FLAGS & SHOW_SIZES)) {
+        mbstowcs(WBUF, ENAME(j), PATH_MAX);
         if (ISLINK(j))
-            wcolor_set(rover.window, RVC_LINK, NULL);
-        else if (ishidden)
-            wcolor_set(rover.window, RVC_HIDDEN, NULL);
-        else if (S_ISREG(EMODE(j))) {
-            if (EMODE(j) & (S_IXUSR | S_IXGRP | S_IXOTH))
-                wcolor_set(rover.window, RVC_EXEC, NULL);
-            else
-                wcolor_set(rover.window, RVC_REG, NULL);
-        } else if (S_ISDIR(EMODE(j)))
-            wcolor_set(rover.window, RVC_DIR, NULL);
-        else if (S_ISCHR(EMODE(j)))
-            wcolor_set(rover.window, RVC_CHR, NULL);
-        else if (S_ISBLK(EMODE(j)))
-            wcolor_set(rover.window, RVC_BLK, NULL);
-        else if (S_ISFIFO(EMODE(j)))
-            wcolor_set(rover.window, RVC_FIFO, NULL);
-        else if (S_ISSOCK(EMODE(j)))
-            wcolor_set(rover.window, RVC_SOCK, NULL);
-        if (S_ISDIR(EMODE(j))) {
-            mbstowcs(WBUF, ENAME(j), PATH_MAX);
-            if (ISLINK(j))
-                wcscat(WBUF, L"/");
-        } else {
-            char *suffix, *suffixes = "BKMGTPEZY";
-            off_t human_size = ESIZE(j) * 10;
-            int length = mbstowcs(WBUF, ENAME(j), PATH_MAX);
-            int namecols = wcswidth(WBUF, length);
-            for (suffix = suffixes; human_size >= 10240; suffix++)
-                human_size = (human_size + 512) / 1024;
-            if (*suffix == 'B')
-                swprintf(WBUF + length, PATH_MAX - length, L"%*d %c",
-                         (int) (COLS - namecols - 6),
-                         (int) human_size / 10, *suffix);
-            else
-                swprintf(WBUF + length, PATH_MAX - length, L"%*d.%d %c",
-                         (int) (COLS - namecols - 8),
-                         (int) human_size / 10, (int) human_size % 10, *suffix);
+            wcscat(WBUF, L"/");
+    } else {
+        char *suffix, *suffixes = "BKMGTPEZY";
+        off_t human_size = ESIZE(j) * 10;
+        int length = mbstowcs(WBUF, ENAME(j), PATH_MAX);
+        int namecols;
+        if (S_ISDIR(EMODE(j)) && ISLINK(j)) {
+            wcscat(WBUF, L"/");
+            length++;
         }
-        mvwhline(rover.window, i + 1, 1, ' ', COLS - 2);
-        mvwaddnwstr(rover.window, i + 1, 2, WBUF, COLS - 4);
-        if (marking && MARKED(j)) {
-            wcolor_set(rover.window, RVC_MARKS, NULL);
-            mvwaddch(rover.window, i + 1, 1, RVS_MARK);
-        } else
-            mvwaddch(rover.window, i + 1, 1, ' ');
-        if (j == ESEL)
-            wattr_off(rover.window, A_REVERSE, NULL);
+        namecols = wcswidth(WBUF, length);
+        for (suffix = suffixes; human_size >= 10240; suffix++)
+            human_size = (human_size + 512) / 1024;
+        if (ESIZE(j) < 0)
+            /* Size of directory still being computed. */
+            swprintf(WBUF + length, PATH_MAX - length, L"%*s",
+                     (int) (COLS - namecols - 4), "...");
+        else if (rover.find[0] && rover.grep)
+            /* Number of lines found by a grep. */
+            swprintf(WBUF + length, PATH_MAX - length, L"%*lld %s",
+                     (int) (COLS - namecols - 10), (long long) ESIZE(j),
+                     ESIZE(j) == 1 ? "line " : "lines");
+        else if (*suffix == 'B')
+            swprintf(WBUF + length, PATH_MAX - length, L"%*d %c",
+                     (int) (COLS - namecols - 6),
+                     (int) human_size / 10, *suffix);
+        else
+            swprintf(WBUF + length, PATH_MAX - length, L"%*d.%d %c",
+                     (int) (COLS - namecols - 8),
+                     (int) human_size / 10, (int) human_size % 10, *suffix);
     }
-    for (; i < HEIGHT; i++)
-        mvwhline(rover.window, i + 1, 1, ' ', COLS - 2);
+    mvwhline(rover.window, i + 1, 1, ' ', COLS - 2);
+    mvwaddnwstr(rover.window, i + 1, 2, WBUF, COLS - 4);
+    if (marking && MARKED(j)) {
+        wcolor_set(rover.window, RVC_MARKS, NULL);
+        mvwaddch(rover.window, i + 1, 1, RVS_MARK);
+    } else
+        mvwaddch(rover.window, i + 1, 1, ' ');
+    if (j == ESEL)
+        wattr_off(rover.window, A_REVERSE, NULL);
+}
+
+/* Draw the scrollbar over the right border and the status line. */
+static void
+draw_position()
+{
     if (rover.nfiles > HEIGHT) {
         int center, height;
         center = (SCROLL + HEIGHT / 2) * HEIGHT / rover.nfiles;
@@ -539,333 +1140,4149 @@ update_view()
         strcpy(BUF2, "0/0");
     else
         snprintf(BUF2, BUFLEN, "%d/%d", ESEL + 1, rover.nfiles);
+    if (rover.load)
+        strcat(BUF2, "+");
     snprintf(BUF1+3, BUFLEN-3, "%12s", BUF2);
     color_set(RVC_STATUS, NULL);
     mvaddstr(LINES - 1, STATUSPOS, BUF1);
-    wrefresh(rover.window);
+    if (profile.overlay)
+        draw_profile();
 }
 
-/* Show a message on the status bar. */
+/* Keep the selection within the listing and the scroll such that the
+   selection is visible. */
 static void
-message(Color color, char *fmt, ...)
+fix_scroll()
 {
-    int len, pos;
-    va_list args;
-
-    va_start(args, fmt);
-    vsnprintf(BUF1, MIN(BUFLEN, STATUSPOS), fmt, args);
-    va_end(args);
-    len = strlen(BUF1);
-    pos = (STATUSPOS - len) / 2;
-    attr_on(A_BOLD, NULL);
-    color_set(color, NULL);
-    mvaddstr(LINES - 1, pos, BUF1);
-    color_set(DEFAULT, NULL);
-    attr_off(A_BOLD, NULL);
+    ESEL = MAX(MIN(ESEL, rover.nfiles - 1), 0);
+    /* Selection might not be visible, due to cursor wrapping or window
+       shrinking. In that case, the scroll must be moved to make it visible. */
+    if (rover.nfiles > HEIGHT) {
+        SCROLL = MAX(MIN(SCROLL, ESEL), ESEL - HEIGHT + 1);
+        SCROLL = MIN(MAX(SCROLL, 0), rover.nfiles - HEIGHT);
+    } else
+        SCROLL = 0;
 }
 
-/* Clear message area, leaving only status info. */
+/* Remember what the listing window shows, for update_cursor(). */
 static void
-clear_message()
+set_drawn()
 {
-    mvhline(LINES - 1, 0, ' ', STATUSPOS);
+    rover.drawn.valid = 1;
+    rover.drawn.tab = rover.tab;
+    rover.drawn.gen = rover.gen;
+    rover.drawn.names = rover.list.names;
+    rover.drawn.nfiles = rover.nfiles;
+    rover.drawn.esel = ESEL;
+    rover.drawn.scroll = SCROLL;
 }
 
-/* Comparison used to sort listing entries. */
-static int
-rowcmp(const void *a, const void *b)
+/* Update the listing view. */
+static void
+update_view()
 {
-    int isdir1, isdir2, cmpdir;
-    const Row *r1 = a;
-    const Row *r2 = b;
-    isdir1 = S_ISDIR(r1->mode);
-    isdir2 = S_ISDIR(r2->mode);
-    cmpdir = isdir2 - isdir1;
-    return cmpdir ? cmpdir : strcoll(r1->name, r2->name);
-}
+    int i, j;
+    int numsize;
+    int marking;
+    long long t, t_draw, t_output;
 
-/* Get all entries in current working directory. */
-static int
-ls(Row **rowsp, uint8_t flags)
+    if (rover.show_jobs) {
+        rover.drawn.valid = 0;
+        update_jobs_view();
+        return;
+    }
+    t = prof_start();
+    mvhline(0, 0, ' ', COLS);
+    attr_on(A_BOLD, NULL);
+    color_set(RVC_TABNUM, NULL);
+    mvaddch(0, COLS - 2, rover.tab + '0');
+    attr_off(A_BOLD, NULL);
+    if (rover.marks.nentries) {
+        numsize = snprintf(BUF1, BUFLEN, "%d", rover.marks.nentries);
+        color_set(RVC_MARKS, NULL);
+        mvaddstr(0, COLS - 3 - numsize, BUF1);
+    } else
+        numsize = -1;
+    color_set(RVC_CWD, NULL);
+    if (rover.find[0]) {
+        /* Both are clipped; no more than a line of them is shown. */
+        snprintf(BUF1, BUFLEN, "%.*s (%s: %.*s)", PATH_MAX / 2, CWD,
+                 rover.grep ? "grep" : "find", BUFLEN / 4, rover.find);
+        mbstowcs(WBUF, BUF1, PATH_MAX);
+    } else
+        mbstowcs(WBUF, CWD, PATH_MAX);
+    mvaddnwstr(0, 0, WBUF, COLS - 4 - numsize);
+    wcolor_set(rover.window, RVC_BORDER, NULL);
+    wborder(rover.window, 0, 0, 0, 0, 0, 0, 0, 0);
+    fix_scroll();
+    marking = !strcmp(CWD, rover.marks.dirpath);
+    t_draw = prof_start();
+    for (i = 0, j = SCROLL; i < HEIGHT && j < rover.nfiles; i++, j++)
+        draw_row(j, marking);
+    prof_end(PROF_DRAW, t_draw, 0);
+    for (; i < HEIGHT; i++)
+        mvwhline(rover.window, i + 1, 1, ' ', COLS - 2);
+    draw_position();
+    set_drawn();
+    t_output = prof_start();
+    wrefresh(rover.window);
+    prof_end(PROF_OUTPUT, t_output, 0);
+    prof_end(PROF_VIEW, t, 0);
+}
+
+/* Update the view after the cursor moved, when nothing else has changed.
+   Only the rows that differ from what is on the screen are drawn: the
+   previous and the new selection, and the rows scrolled into view. The
+   rest of the window is moved with the terminal's scrolling. */
+static void
+update_cursor()
+{
+    int i, first, last, delta, marking;
+    long long t, t_draw, t_output;
+
+    if (!rover.drawn.valid || rover.show_jobs ||
+        rover.drawn.tab != rover.tab || rover.drawn.gen != rover.gen ||
+        rover.drawn.names != rover.list.names ||
+        rover.drawn.nfiles != rover.nfiles) {
+        update_view();
+        return;
+    }
+    fix_scroll();
+    delta = SCROLL - rover.drawn.scroll;
+    if (delta >= HEIGHT || -delta >= HEIGHT) {
+        update_view();
+        return;
+    }
+    t = prof_start();
+    marking = !strcmp(CWD, rover.marks.dirpath);
+    t_draw = prof_start();
+    if (delta) {
+        wsetscrreg(rover.window, 1, HEIGHT);
+        scrollok(rover.window, TRUE);
+        wscrl(rover.window, delta);
+        scrollok(rover.window, FALSE);
+        /* The lines scrolled in are blank and the scrollbar moved along;
+           restore the borders. */
+        wcolor_set(rover.window, RVC_BORDER, NULL);
+        mvwvline(rover.window, 1, 0, 0, HEIGHT);
+        mvwvline(rover.window, 1, COLS - 1, 0, HEIGHT);
+        if (delta > 0) {
+            first = SCROLL + HEIGHT - delta;
+            last = SCROLL + HEIGHT;
+        } else {
+            first = SCROLL;
+            last = SCROLL - delta;
+        }
+        for (i = first; i < last && i < rover.nfiles; i++)
+            draw_row(i, marking);
+    }
+    i = rover.drawn.esel;
+    if (i >= SCROLL && i < SCROLL + HEIGHT && i < rover.nfiles)
+        draw_row(i, marking);
+    draw_row(ESEL, marking);
+    prof_end(PROF_DRAW, t_draw, 0);
+    draw_position();
+    set_drawn();
+    t_output = prof_start();
+    wrefresh(rover.window);
+    prof_end(PROF_OUTPUT, t_output, 0);
+    prof_end(PROF_CURSOR, t, 0);
+}
+
+/* Show a message on the status bar. */
+static void
+message(Color color, char *fmt, ...)
+{
+    int len, pos;
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(BUF1, MIN(BUFLEN, STATUSPOS), fmt, args);
+    va_end(args);
+    len = strlen(BUF1);
+    pos = (STATUSPOS - len) / 2;
+    attr_on(A_BOLD, NULL);
+    color_set(color, NULL);
+    mvaddstr(LINES - 1, pos, BUF1);
+    color_set(DEFAULT, NULL);
+    attr_off(A_BOLD, NULL);
+}
+
+/* Clear message area, leaving only status info. */
+static void
+clear_message()
+{
+    mvhline(LINES - 1, 0, ' ', STATUSPOS);
+}
+
+/* Take chunks of the shared range and process them until none is left. */
+static void *
+parallel_worker(void *arg)
+{
+    Parallel *par = arg;
+    int first;
+
+    while (1) {
+        pthread_mutex_lock(&par->lock);
+        first = par->next;
+        par->next += par->chunk;
+        pthread_mutex_unlock(&par->lock);
+        if (first >= par->count)
+            break;
+        par->work(par->arg, first, MIN(first + par->chunk, par->count));
+    }
+    return NULL;
+}
+
+/* Call work() on every chunk of the range [0, count), using up to nthreads
+   threads (including the caller). Returns when all chunks are done. */
+static void
+run_parallel(int nthreads, int count, int chunk, WORK work, void *arg)
+{
+    Parallel par;
+    pthread_t *threads;
+    int i, n;
+
+    n = MIN(nthreads, (count + chunk - 1) / chunk) - 1;
+    if (n <= 0) {
+        if (count > 0)
+            work(arg, 0, count);
+        return;
+    }
+    pthread_mutex_init(&par.lock, NULL);
+    par.next = 0;
+    par.count = count;
+    par.chunk = chunk;
+    par.work = work;
+    par.arg = arg;
+    threads = malloc(n * sizeof *threads);
+    for (i = 0; i < n; i++)
+        if (pthread_create(&threads[i], NULL, parallel_worker, &par))
+            break;
+    n = i;
+    parallel_worker(&par);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&par.lock);
+}
+
+/* Make sure the first block of an arena has room for size bytes. */
+static void
+arena_reserve(Arena *arena, size_t size)
+{
+    Block *block = arena->blocks;
+
+    if (block && block->size - block->used >= size)
+        return;
+    size = MAX(size, block ? block->size * 2 : ARENA_BLOCK);
+    block = malloc(sizeof *block + size);
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = 0;
+    arena->blocks = block;
+}
+
+static char *
+arena_alloc(Arena *arena, size_t size)
+{
+    char *p;
+
+    arena_reserve(arena, size);
+    p = arena->blocks->data + arena->blocks->used;
+    arena->blocks->used += size;
+    return p;
+}
+
+static char *
+arena_strdup(Arena *arena, const char *str, size_t extra)
+{
+    size_t size = strlen(str) + 1;
+
+    return memcpy(arena_alloc(arena, size + extra), str, size);
+}
+
+/* Move all blocks of src into dst, leaving src empty. */
+static void
+arena_move(Arena *dst, Arena *src)
+{
+    Block *last;
+
+    if (!src->blocks)
+        return;
+    if (!dst->blocks) {
+        dst->blocks = src->blocks;
+    } else {
+        /* Keep the first block of dst, where allocations happen. */
+        for (last = src->blocks; last->next; last = last->next)
+            ;
+        last->next = dst->blocks->next;
+        dst->blocks->next = src->blocks;
+    }
+    src->blocks = NULL;
+}
+
+static void
+arena_free(Arena *arena)
+{
+    Block *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->blocks = NULL;
+}
+
+/* Hash of a name or path (FNV-1a). */
+static unsigned
+hash_name(const char *str)
+{
+    unsigned hash = 2166136261u;
+
+    while (*str)
+        hash = (hash ^ (unsigned char) *str++) * 16777619u;
+    return hash;
+}
+
+/* Slot holding entry, or the empty slot where it would go. */
+static int
+mark_slot(Marks *marks, const char *entry, unsigned hash)
+{
+    int i, mask = marks->bulk - 1;
+
+    for (i = hash & mask; marks->entries[i]; i = (i + 1) & mask)
+        if (marks->hashes[i] == hash && !strcmp(marks->entries[i], entry))
+            break;
+    return i;
+}
+
+static void
+alloc_marks(Marks *marks, int bulk)
+{
+    marks->bulk = bulk;
+    marks->entries = calloc(bulk, sizeof *marks->entries);
+    marks->hashes = malloc(bulk * sizeof *marks->hashes);
+}
+
+static void
+init_marks(Marks *marks)
+{
+    strcpy(marks->dirpath, "");
+    marks->nentries = 0;
+    marks->names.blocks = NULL;
+    alloc_marks(marks, BULK_INIT);
+}
+
+/* Unmark all entries. */
+static void
+mark_none(Marks *marks)
+{
+    strcpy(marks->dirpath, "");
+    if (marks->nentries)
+        memset(marks->entries, 0, marks->bulk * sizeof *marks->entries);
+    marks->nentries = 0;
+    arena_free(&marks->names);
+    if (marks->bulk > BULK_THRESH) {
+        /* Reset bulk to free some memory. */
+        free(marks->entries);
+        free(marks->hashes);
+        alloc_marks(marks, BULK_INIT);
+    }
+}
+
+/* Double the table, copying the names that are still marked to a new arena
+   so that the names of deleted marks are reclaimed. */
+static void
+grow_marks(Marks *marks)
+{
+    char **entries = marks->entries;
+    unsigned *hashes = marks->hashes;
+    int i, j, bulk = marks->bulk;
+    Arena names = {NULL};
+
+    alloc_marks(marks, bulk * 2);
+    for (i = 0; i < bulk; i++)
+        if (entries[i]) {
+            j = mark_slot(marks, entries[i], hashes[i]);
+            marks->entries[j] = arena_strdup(&names, entries[i], 0);
+            marks->hashes[j] = hashes[i];
+        }
+    arena_free(&marks->names);
+    marks->names = names;
+    free(entries);
+    free(hashes);
+}
+
+static void
+add_mark(Marks *marks, char *dirpath, char *entry)
+{
+    int i;
+    unsigned hash;
+
+    if (strcmp(marks->dirpath, dirpath)) {
+        /* Directory changed. Discard old marks. */
+        mark_none(marks);
+        strcpy(marks->dirpath, dirpath);
+    }
+    /* Keep the load factor at most 1/2 so that probe sequences stay short. */
+    if (2 * (marks->nentries + 1) > marks->bulk)
+        grow_marks(marks);
+    hash = hash_name(entry);
+    i = mark_slot(marks, entry, hash);
+    if (marks->entries[i])
+        return;
+    marks->entries[i] = arena_strdup(&marks->names, entry, 0);
+    marks->hashes[i] = hash;
+    marks->nentries++;
+}
+
+static void
+del_mark(Marks *marks, char *entry)
+{
+    int i, j, home, mask = marks->bulk - 1;
+
+    if (marks->nentries > 1) {
+        i = mark_slot(marks, entry, hash_name(entry));
+        if (!marks->entries[i])
+            return;
+        /* Shift back the following entries of the cluster that would no
+           longer be reachable from their home slot across the hole. */
+        for (j = (i + 1) & mask; marks->entries[j]; j = (j + 1) & mask) {
+            home = marks->hashes[j] & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                marks->entries[i] = marks->entries[j];
+                marks->hashes[i] = marks->hashes[j];
+                i = j;
+            }
+        }
+        marks->entries[i] = NULL;
+        marks->nentries--;
+    } else
+        mark_none(marks);
+}
+
+static int
+find_mark(Marks *marks, const char *entry)
+{
+    if (!marks->nentries)
+        return 0;
+    return marks->entries[mark_slot(marks, entry, hash_name(entry))] != NULL;
+}
+
+static void
+free_marks(Marks *marks)
+{
+    arena_free(&marks->names);
+    free(marks->entries);
+    free(marks->hashes);
+}
+
+/* Make a sort key in an arena from the type of an entry, a prefix of plen
+   bytes and the transformed name. */
+static char *
+make_prefixed_key(Arena *arena, const char *prefix, size_t plen,
+                  const char *name, int isdir, int bytes)
+{
+    char *key;
+    size_t size, len;
+
+    if (bytecmp || bytes) {
+        len = strlen(name);
+        key = arena_alloc(arena, plen + len + 2);
+        key[0] = isdir ? KEY_DIR : KEY_FILE;
+        memcpy(key + 1, prefix, plen);
+        memcpy(key + 1 + plen, name, len + 1);
+        return key;
+    }
+    size = strlen(name) * 4 + 16;
+    while (1) {
+        arena_reserve(arena, plen + size + 1);
+        key = arena->blocks->data + arena->blocks->used;
+        key[0] = isdir ? KEY_DIR : KEY_FILE;
+        memcpy(key + 1, prefix, plen);
+        len = strxfrm(key + 1 + plen, name, size);
+        if (len < size)
+            break;
+        size = len + 1;
+    }
+    arena->blocks->used += plen + len + 2;
+    return key;
+}
+
+/* Make the sort key of an entry in an arena. Comparing keys with strcmp()
+   is the same as comparing names with strcoll(), directories first, or
+   with strcmp() if bytes is set. */
+static char *
+make_key(Arena *arena, const char *name, int isdir, int bytes)
+{
+    return make_prefixed_key(arena, "", 0, name, isdir, bytes);
+}
+
+/* Make a sort key that puts bigger entries first, then orders them by name
+   as make_key() does. Unknown sizes (negative) sort as zero. */
+static char *
+make_size_key(Arena *arena, const char *name, int isdir, off_t size,
+              int bytes)
+{
+    char prefix[17];
+
+    snprintf(prefix, sizeof prefix, "%016llx",
+             ~(unsigned long long) MAX(size, 0));
+    return make_prefixed_key(arena, prefix, 16, name, isdir, bytes);
+}
+
+/* Comparison used to sort listing entries. */
+static int
+rowcmp(const void *a, const void *b)
+{
+    const Row *r1 = a;
+    const Row *r2 = b;
+    return strcmp(r1->key, r2->key);
+}
+
+/* Merge two sorted arrays of rows into dst. */
+static void
+merge_into(Row *dst, const Row *rows1, int n1, const Row *rows2, int n2)
+{
+    int i, j, k;
+
+    for (i = j = k = 0; i < n1 || j < n2; k++)
+        if (j == n2 || (i < n1 && rowcmp(&rows1[i], &rows2[j]) <= 0))
+            dst[k] = rows1[i++];
+        else
+            dst[k] = rows2[j++];
+}
+
+/* Merge two sorted arrays of rows into a new one. */
+static Row *
+merge_rows(Row *rows1, int n1, Row *rows2, int n2)
+{
+    Row *rows;
+
+    rows = malloc((n1 + n2) * sizeof *rows);
+    merge_into(rows, rows1, n1, rows2, n2);
+    return rows;
+}
+
+/* Rows being sorted by sort_rows(), in runs of the given width. */
+typedef struct Sort {
+    Row *src;
+    Row *dst;
+    int n;
+    int width;
+} Sort;
+
+static void
+sort_runs(void *arg, int first, int last)
+{
+    Sort *sort = arg;
+    int lo, hi;
+
+    for (; first < last; first++) {
+        lo = first * sort->width;
+        hi = MIN(lo + sort->width, sort->n);
+        qsort(sort->src + lo, hi - lo, sizeof *sort->src, rowcmp);
+    }
+}
+
+static void
+merge_runs(void *arg, int first, int last)
+{
+    Sort *sort = arg;
+    int lo, mid, hi;
+
+    for (; first < last; first++) {
+        lo = first * 2 * sort->width;
+        mid = MIN(lo + sort->width, sort->n);
+        hi = MIN(mid + sort->width, sort->n);
+        merge_into(sort->dst + lo, sort->src + lo, mid - lo,
+                   sort->src + mid, hi - mid);
+    }
+}
+
+/* Sort rows, using a parallel merge sort for large listings. */
+static void
+sort_rows(Row *rows, int n)
+{
+    Sort sort;
+    Row *tmp;
+    int nruns;
+
+    if (n < SORT_THRESH || RV_STAT_THREADS < 2) {
+        if (n > 1)
+            qsort(rows, n, sizeof *rows, rowcmp);
+        return;
+    }
+    tmp = malloc(n * sizeof *tmp);
+    sort.src = rows;
+    sort.dst = tmp;
+    sort.n = n;
+    sort.width = (n + RV_STAT_THREADS - 1) / RV_STAT_THREADS;
+    nruns = (n + sort.width - 1) / sort.width;
+    run_parallel(RV_STAT_THREADS, nruns, 1, sort_runs, &sort);
+    while (nruns > 1) {
+        nruns = (nruns + 1) / 2;
+        run_parallel(RV_STAT_THREADS, nruns, 1, merge_runs, &sort);
+        sort.dst = sort.src;
+        sort.src = sort.src == rows ? tmp : rows;
+        sort.width *= 2;
+    }
+    if (sort.src != rows)
+        memcpy(rows, sort.src, n * sizeof *rows);
+    free(tmp);
+}
+
+/* Position of the first row in listing that doesn't sort before the given
+   sort key. */
+static int
+row_bound(const char *key)
+{
+    int lo, hi, mid;
+
+    lo = 0;
+    hi = rover.nfiles;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(EKEY(mid), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void
+free_rows(Row **rowsp, Arena *names)
+{
+    free(*rowsp);
+    *rowsp = NULL;
+    arena_free(names);
+}
+
+/* Memory taken by a name and its sort key. In byte order, the key is the
+   name itself, after the byte that puts directories first. */
+static size_t
+names_size(const char *name, const char *key)
+{
+    if (key + 1 == name)
+        return strlen(key) + 1;
+    return strlen(name) + strlen(key) + 2;
+}
+
+/* Make room for n entries in the columns of a listing. */
+static void
+list_reserve(Listing *list, int n)
+{
+    if (n <= list->bulk)
+        return;
+    list->bulk = MAX(n, list->bulk * 2);
+    list->names = realloc(list->names, list->bulk * sizeof *list->names);
+    list->keys = realloc(list->keys, list->bulk * sizeof *list->keys);
+    list->sizes = realloc(list->sizes, list->bulk * sizeof *list->sizes);
+    list->modes = realloc(list->modes, list->bulk * sizeof *list->modes);
+    list->links = realloc(list->links, list->bulk * sizeof *list->links);
+    list->marks = realloc(list->marks, list->bulk * sizeof *list->marks);
+}
+
+/* Make room for size more bytes of strings in a listing. Offsets into the
+   blob must fit in 32 bits; returns -1 if they wouldn't. */
+static int
+list_reserve_blob(Listing *list, size_t size)
+{
+    if (list->bloblen + size > UINT32_MAX)
+        return -1;
+    if (list->bloblen + size > list->blobbulk) {
+        list->blobbulk = MAX(list->bloblen + size, list->blobbulk * 2);
+        list->blob = realloc(list->blob, list->blobbulk);
+    }
+    return 0;
+}
+
+/* Append a string to the blob of a listing, which must have room for it.
+   Returns its offset. */
+static uint32_t
+list_string(Listing *list, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint32_t off = list->bloblen;
+
+    memcpy(list->blob + off, str, len);
+    list->bloblen += len;
+    return off;
+}
+
+/* Store the name and sort key of entry i of a listing in its blob. */
+static void
+list_put_names(Listing *list, int i, const char *name, const char *key)
+{
+    if (key + 1 == name) {
+        list->keys[i] = list_string(list, key);
+        list->names[i] = list->keys[i] + 1;
+    } else {
+        list->names[i] = list_string(list, name);
+        list->keys[i] = list_string(list, key);
+    }
+}
+
+/* Store a row as entry i of a listing, with room for its strings. */
+static void
+list_set(Listing *list, int i, const Row *row)
+{
+    list_put_names(list, i, row->name, row->key);
+    list->sizes[i] = row->size;
+    list->modes[i] = row->mode;
+    list->links[i] = row->islink;
+    list->marks[i] = row->marked;
+}
+
+/* Copy entry j of a listing to entry i of another, strings aside. */
+static void
+list_copy_entry(Listing *dst, int i, const Listing *src, int j)
+{
+    dst->names[i] = src->names[j];
+    dst->keys[i] = src->keys[j];
+    dst->sizes[i] = src->sizes[j];
+    dst->modes[i] = src->modes[j];
+    dst->links[i] = src->links[j];
+    dst->marks[i] = src->marks[j];
+}
+
+/* Move count entries of a listing from position src to position dst. */
+static void
+list_move(Listing *list, int dst, int src, int count)
+{
+    memmove(&list->names[dst], &list->names[src], count * sizeof *list->names);
+    memmove(&list->keys[dst], &list->keys[src], count * sizeof *list->keys);
+    memmove(&list->sizes[dst], &list->sizes[src], count * sizeof *list->sizes);
+    memmove(&list->modes[dst], &list->modes[src], count * sizeof *list->modes);
+    memmove(&list->links[dst], &list->links[src], count * sizeof *list->links);
+    memmove(&list->marks[dst], &list->marks[src], count * sizeof *list->marks);
+}
+
+/* Memory taken by the strings of the first n entries of a listing. */
+static size_t
+list_names_size(const Listing *list, int n)
+{
+    size_t size;
+    int i;
+
+    for (size = 0, i = 0; i < n; i++)
+        size += names_size(list->blob + list->names[i],
+                           list->blob + list->keys[i]);
+    return size;
+}
+
+/* Copy the first n entries of a listing to a new one, laying out their
+   strings in listing order. */
+static void
+copy_listing(Listing *dst, const Listing *src, int n)
+{
+    int i;
+
+    memset(dst, 0, sizeof *dst);
+    list_reserve(dst, n);
+    list_reserve_blob(dst, list_names_size(src, n));
+    for (i = 0; i < n; i++) {
+        list_copy_entry(dst, i, src, i);
+        list_put_names(dst, i, src->blob + src->names[i],
+                       src->blob + src->keys[i]);
+    }
+}
+
+static void
+free_listing(Listing *list)
+{
+    if (list->map) {
+        munmap(list->map, list->maplen);
+        memset(list, 0, sizeof *list);
+        return;
+    }
+    free(list->names);
+    free(list->keys);
+    free(list->sizes);
+    free(list->modes);
+    free(list->links);
+    free(list->marks);
+    free(list->blob);
+    memset(list, 0, sizeof *list);
+}
+
+/* Get the key of the listing of a directory, given its status. */
+static void
+dir_key(DirKey *key, const struct stat *statbuf, uint8_t flags)
+{
+    memset(key, 0, sizeof *key);
+    key->dev = statbuf->st_dev;
+    key->ino = statbuf->st_ino;
+    key->mtime = statbuf->st_mtim;
+    key->flags = flags;
+}
+
+static int
+same_key(const DirKey *key1, const DirKey *key2)
+{
+    return key1->dev == key2->dev && key1->ino == key2->ino &&
+           key1->mtime.tv_sec == key2->mtime.tv_sec &&
+           key1->mtime.tv_nsec == key2->mtime.tv_nsec &&
+           key1->flags == key2->flags;
+}
+
+static void
+cache_unlink(Cached *cached)
+{
+    if (cached->prev)
+        cached->prev->next = cached->next;
+    else
+        rover.cache = cached->next;
+    if (cached->next)
+        cached->next->prev = cached->prev;
+    cached->prev = cached->next = NULL;
+}
+
+static void
+cache_drop(Cached *cached)
+{
+    cache_unlink(cached);
+    rover.cache_size -= cached->size;
+    free_listing(&cached->list);
+    free(cached);
+}
+
+/* Find a listing in the cache, making it the most recently used. */
+static Cached *
+cache_find(const DirKey *key)
+{
+    Cached *cached;
+
+    for (cached = rover.cache; cached; cached = cached->next)
+        if (same_key(&cached->key, key)) {
+            cache_unlink(cached);
+            cached->next = rover.cache;
+            if (rover.cache)
+                rover.cache->prev = cached;
+            rover.cache = cached;
+            return cached;
+        }
+    return NULL;
+}
+
+/* Keep a copy of a listing, evicting the least recently used ones to stay
+   under RV_CACHE_SIZE bytes. Older versions of the same directory go too. */
+static void
+cache_put(const DirKey *key, const Listing *list, int n)
+{
+    Cached *cached, *next;
+    size_t size;
+
+    size = sizeof *cached + n * LIST_ENTRY + list_names_size(list, n);
+    if (size > RV_CACHE_SIZE)
+        return;
+    for (cached = rover.cache; cached; cached = next) {
+        next = cached->next;
+        if (cached->key.dev == key->dev && cached->key.ino == key->ino)
+            cache_drop(cached);
+    }
+    while (rover.cache && rover.cache_size + size > RV_CACHE_SIZE) {
+        for (cached = rover.cache; cached->next; cached = cached->next)
+            ;
+        cache_drop(cached);
+    }
+    cached = calloc(1, sizeof *cached);
+    cached->key = *key;
+    cached->nrows = n;
+    copy_listing(&cached->list, list, n);
+    cached->size = size;
+    cached->next = rover.cache;
+    if (rover.cache)
+        rover.cache->prev = cached;
+    rover.cache = cached;
+    rover.cache_size += size;
+}
+
+/* Forget cached listings of the current working directory. */
+static void
+uncache_cwd()
+{
+    Cached *cached, *next;
+    struct stat statbuf;
+
+    if (stat(".", &statbuf) == -1)
+        return;
+    for (cached = rover.cache; cached; cached = next) {
+        next = cached->next;
+        if (cached->key.dev == statbuf.st_dev &&
+            cached->key.ino == statbuf.st_ino)
+            cache_drop(cached);
+    }
+}
+
+static int
+load_cancelled(Load *load)
+{
+    int cancel;
+
+    pthread_mutex_lock(&load->lock);
+    cancel = load->cancel;
+    pthread_mutex_unlock(&load->lock);
+    return cancel;
+}
+
+/* Hand a sorted batch of rows over to the main thread.
+   Returns -1 if the load was cancelled in the meantime. */
+static int
+load_publish(Load *load, Row *rows, int n, Arena *names)
+{
+    Row *merged;
+    int i;
+
+    pthread_mutex_lock(&load->lock);
+    if (load->budget) {
+        for (i = 0; i < n; i++)
+            load->used += LIST_ENTRY + names_size(rows[i].name, rows[i].key);
+        if (load->used > load->budget)
+            load->cancel = 1;
+    }
+    if (load->cancel) {
+        pthread_mutex_unlock(&load->lock);
+        free_rows(&rows, names);
+        return -1;
+    }
+    if (load->nrows) {
+        /* Main thread is behind; keep pending rows sorted for it. */
+        merged = merge_rows(load->rows, load->nrows, rows, n);
+        free(load->rows);
+        free(rows);
+        rows = merged;
+    }
+    load->rows = rows;
+    load->nrows += n;
+    arena_move(&load->names, names);
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->lock);
+    return 0;
+}
+
+/* Drop a reference to a load, freeing it if it was the last one. */
+static void
+release_load(Load *load)
+{
+    int refs;
+
+    pthread_mutex_lock(&load->lock);
+    refs = --load->refs;
+    pthread_mutex_unlock(&load->lock);
+    if (refs)
+        return;
+    free_rows(&load->rows, &load->names);
+    free_listing(&load->index);
+    free(load->path);
+    free(load->pattern);
+    free(load->roots);
+    pthread_cond_destroy(&load->cond);
+    pthread_mutex_destroy(&load->lock);
+    free(load);
+}
+
+/* Entry of the size table for a directory. Caller must hold the lock. */
+static DirSize *
+find_size(dev_t dev, ino_t ino)
+{
+    DirSize *entry;
+
+    for (entry = rover.sizer.sizes[SIZE_BUCKET(dev, ino)]; entry;
+         entry = entry->next)
+        if (entry->dev == dev && entry->ino == ino)
+            break;
+    return entry;
+}
+
+/* Recursive size of the directory with the given identity, or -1 if it's
+   not known yet. */
+static off_t
+dir_size(dev_t dev, ino_t ino)
+{
+    DirSize *entry;
+    off_t size;
+
+    pthread_mutex_lock(&rover.sizer.lock);
+    entry = find_size(dev, ino);
+    size = entry ? entry->size : -1;
+    pthread_mutex_unlock(&rover.sizer.lock);
+    return size;
+}
+
+/* Forget all directory sizes, as they may have changed. */
+static void
+forget_sizes()
+{
+    DirSize *entry, *next;
+    int i;
+
+    pthread_mutex_lock(&rover.sizer.lock);
+    for (i = 0; i < SIZE_BUCKETS; i++) {
+        for (entry = rover.sizer.sizes[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+        rover.sizer.sizes[i] = NULL;
+    }
+    pthread_mutex_unlock(&rover.sizer.lock);
+}
+
+/* Open the directory at the first len bytes of path, which may be longer
+   than PATH_MAX: it's then resolved in pieces. Flags are added to the
+   opening of the last piece. */
+static int
+open_dir_path(const char *path, size_t len, int flags)
+{
+    char piece[PATH_MAX];
+    size_t n;
+    int fd, next;
+
+    fd = AT_FDCWD;
+    while (len) {
+        n = len;
+        if (n >= PATH_MAX)
+            for (n = PATH_MAX - 1; n && path[n - 1] != '/'; n--)
+                ;
+        if (!n) {
+            errno = ENAMETOOLONG;
+            next = -1;
+        } else {
+            memcpy(piece, path, n);
+            piece[n] = '\0';
+            next = openat(fd, piece, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                                     (n == len ? flags : 0));
+        }
+        if (fd != AT_FDCWD)
+            close(fd);
+        if (next == -1)
+            return -1;
+        fd = next;
+        path += n;
+        len -= n;
+    }
+    return fd;
+}
+
+/* Remove a directory, by a path that may be longer than PATH_MAX. */
+static int
+remove_dir_path(const char *path)
+{
+    size_t len = strlen(path);
+    const char *name;
+    int fd, ret;
+
+    if (len < PATH_MAX)
+        return rmdir(path);
+    for (name = path + len - 2; name > path && name[-1] != '/'; name--)
+        ;
+    if ((fd = open_dir_path(path, name - path, 0)) == -1)
+        return -1;
+    ret = unlinkat(fd, name, AT_REMOVEDIR);
+    close(fd);
+    return ret;
+}
+
+/* Make room in the path of a walk for len bytes. */
+static void
+walk_reserve(Walk *walk, size_t len)
+{
+    if (len <= walk->pathbulk)
+        return;
+    walk->pathbulk = MAX(len, walk->pathbulk * 2);
+    walk->path = realloc(walk->path, walk->pathbulk);
+}
+
+/* Drop a reference to a listing read ahead, freeing it with the last. */
+static void
+put_walked(Count *count, Walked *walked)
+{
+    int refs;
+
+    pthread_mutex_lock(&count->lock);
+    if (!(refs = --walked->refs))
+        count->cached -= walked->bulk;
+    pthread_mutex_unlock(&count->lock);
+    if (!refs) {
+        free(walked->path);
+        free(walked->data);
+        free(walked);
+    }
+}
+
+/* Read a directory just entered by the counting walk of a job whole, and
+   share its listing with the processing walk, as long as listings stay
+   within COUNT_CACHE_MAX. Past that, it's read as it's walked. */
+static void
+walk_ahead(Walk *walk, WalkDir *dir)
+{
+    Count *count = walk->count;
+    Walked *walked, **bucket;
+    struct dirent *ep;
+    WalkedEntry entry;
+    struct stat st;
+    size_t len, cached;
+
+    pthread_mutex_lock(&count->lock);
+    cached = count->cached;
+    pthread_mutex_unlock(&count->lock);
+    walked = calloc(1, sizeof *walked);
+    while ((ep = readdir(dir->dp))) {
+        if (ep->d_name[0] == '.' && (!ep->d_name[1] ||
+            (ep->d_name[1] == '.' && !ep->d_name[2])))
+            continue;
+        if (fstatat(dirfd(dir->dp), ep->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        len = strlen(ep->d_name) + 1;
+        if (walked->len + sizeof entry + len > walked->bulk) {
+            walked->bulk = MAX(walked->bulk * 2,
+                               walked->len + sizeof entry + len + 4096);
+            if (cached + walked->bulk > COUNT_CACHE_MAX)
+                break;
+            walked->data = realloc(walked->data, walked->bulk);
+        }
+        entry.size = st.st_size;
+        entry.mode = st.st_mode;
+        memcpy(walked->data + walked->len, &entry, sizeof entry);
+        memcpy(walked->data + walked->len + sizeof entry, ep->d_name, len);
+        walked->len += sizeof entry + len;
+    }
+    pthread_mutex_lock(&count->lock);
+    if (ep || count->cached + walked->bulk > COUNT_CACHE_MAX) {
+        pthread_mutex_unlock(&count->lock);
+        free(walked->data);
+        free(walked);
+        rewinddir(dir->dp);
+        return;
+    }
+    count->cached += walked->bulk;
+    walked->path = strdup(walk->path);
+    walked->refs = 2;
+    bucket = &count->walked[hash_name(walk->path) % COUNT_BUCKETS];
+    walked->next = *bucket;
+    *bucket = walked;
+    pthread_mutex_unlock(&count->lock);
+    dir->walked = walked;
+}
+
+/* Take the listing of a directory just entered by the processing walk of a
+   job from its counting walk, if it got there first. */
+static void
+walk_take(Walk *walk, WalkDir *dir)
+{
+    Walked **link, *walked;
+
+    pthread_mutex_lock(&walk->count->lock);
+    link = &walk->count->walked[hash_name(walk->path) % COUNT_BUCKETS];
+    while ((walked = *link) && strcmp(walked->path, walk->path))
+        link = &walked->next;
+    if (walked)
+        *link = walked->next; /* Its reference is the walk's now. */
+    pthread_mutex_unlock(&walk->count->lock);
+    dir->walked = walked;
+}
+
+/* Close a directory of the walk. */
+static void
+walk_close(Walk *walk, WalkDir *dir)
+{
+    if (dir->dp) {
+        closedir(dir->dp);
+        walk->nopen--;
+    }
+    if (dir->dst != -1)
+        close(dir->dst);
+    if (dir->walked)
+        put_walked(walk->count, dir->walked);
+}
+
+/* Reopen a directory of the walk closed by walk_shed(), by path. The
+   listing goes on after the entry walked into last, whose name is still in
+   the path: directory positions from telldir() don't outlive the stream.
+   If it's gone, the directory is read all over again. */
+static int
+walk_reopen(Walk *walk, WalkDir *dir)
+{
+    struct dirent *ep;
+    char *dstpath;
+    const char *name;
+    size_t rel, len;
+    int fd;
+
+    fd = open_dir_path(walk->path, dir->len,
+                       dir == walk->dirs ? 0 : O_NOFOLLOW);
+    if (fd == -1)
+        return -1;
+    if (!(dir->dp = fdopendir(fd))) {
+        close(fd);
+        return -1;
+    }
+    if (!dir->walked && !(walk->names && dir == walk->dirs)) {
+        name = walk->path + dir->len;
+        len = strcspn(name, "/");
+        while ((ep = readdir(dir->dp)) &&
+               (strncmp(ep->d_name, name, len) || ep->d_name[len]))
+            ;
+        if (!ep)
+            rewinddir(dir->dp);
+    }
+    if (walk->dst) {
+        rel = dir->len - walk->dirs[0].len;
+        dstpath = malloc(strlen(walk->dst) + rel + 1);
+        sprintf(dstpath, "%s%.*s", walk->dst, (int) rel,
+                walk->path + walk->dirs[0].len);
+        dir->dst = open_dir_path(dstpath, strlen(dstpath), 0);
+        free(dstpath);
+    }
+    walk->nopen++;
+    return 0;
+}
+
+/* Close the outermost open directory of the walk. */
+static void
+walk_shed(Walk *walk)
+{
+    WalkDir *dir;
+
+    for (dir = walk->dirs; !dir->dp; dir++)
+        ;
+    closedir(dir->dp);
+    dir->dp = NULL;
+    if (dir->dst != -1)
+        close(dir->dst);
+    dir->dst = -1;
+    walk->nopen--;
+}
+
+/* Start walking the tree at path. If fd isn't -1, it's a descriptor of
+   path, owned by the walk from now on. Only the given names of the root are
+   walked, unless names is NULL. Returns -1 if path can't be read. */
+static int
+walk_start(Walk *walk, int fd, const char *path, char **names, int nnames,
+           const char *dst)
+{
+    size_t len = strlen(path);
+
+    memset(walk, 0, sizeof *walk);
+    walk->bulk = 16;
+    walk->dirs = malloc(walk->bulk * sizeof *walk->dirs);
+    walk_reserve(walk, MAX(len + 2, PATH_MAX));
+    memcpy(walk->path, path, len + 1);
+    if (!len || path[len - 1] != '/') {
+        walk->path[len++] = '/';
+        walk->path[len] = '\0';
+    }
+    walk->names = names;
+    walk->nnames = nnames;
+    walk->dst = dst;
+    walk->fd = walk->dstfd = -1;
+    if (fd == -1)
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (!(walk->dirs[0].dp = fdopendir(fd))) {
+        close(fd);
+        return -1;
+    }
+    walk->dirs[0].len = len;
+    walk->dirs[0].walked = NULL;
+    walk->dirs[0].next = 0;
+    walk->dirs[0].dst = dst ? open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                            : -1;
+    walk->depth = 1;
+    walk->nopen = 1;
+    return 0;
+}
+
+static void
+walk_end(Walk *walk)
+{
+    WalkDir *dir;
+
+    for (dir = walk->dirs; dir < walk->dirs + walk->depth; dir++)
+        walk_close(walk, dir);
+    free(walk->dirs);
+    free(walk->path);
+}
+
+/* Enter the current entry, a directory. */
+static int
+walk_push(Walk *walk)
+{
+    WalkDir *top, *dir;
+    size_t len;
+    int fd;
+
+    if (walk->depth == walk->bulk) {
+        walk->bulk *= 2;
+        walk->dirs = realloc(walk->dirs, walk->bulk * sizeof *walk->dirs);
+    }
+    if (walk->nopen >= WALK_FDS)
+        walk_shed(walk);
+    top = &walk->dirs[walk->depth - 1];
+    fd = openat(dirfd(top->dp), walk->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    dir = top + 1;
+    if (!(dir->dp = fdopendir(fd))) {
+        close(fd);
+        return -1;
+    }
+    dir->dst = -1;
+    if (top->dst != -1)
+        dir->dst = openat(top->dst, walk->name,
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    len = top->len + strlen(walk->name);
+    walk_reserve(walk, len + 2);
+    walk->path[len] = '/';
+    walk->path[len + 1] = '\0';
+    dir->len = len + 1;
+    dir->walked = NULL;
+    dir->next = 0;
+    walk->depth++;
+    walk->nopen++;
+    if (walk->count && walk->ahead)
+        walk_ahead(walk, dir);
+    else if (walk->count)
+        walk_take(walk, dir);
+    return 0;
+}
+
+/* Put the name of the next entry of a directory in the path of the walk.
+   Returns 0 at the end of the listing. */
+static int
+walk_read(Walk *walk, WalkDir *dir)
+{
+    struct dirent *ep;
+    WalkedEntry entry;
+    const char *name;
+    size_t len;
+
+    walk->stated = 0;
+    if (dir->walked) {
+        if (dir->next == dir->walked->len)
+            return 0;
+        memcpy(&entry, dir->walked->data + dir->next, sizeof entry);
+        name = dir->walked->data + dir->next + sizeof entry;
+        len = strlen(name);
+        dir->next += sizeof entry + len + 1;
+        memset(&walk->st, 0, sizeof walk->st);
+        walk->st.st_size = entry.size;
+        walk->st.st_mode = entry.mode;
+        walk->stated = 1;
+    } else if (walk->names && dir == walk->dirs) {
+        if (walk->iname == walk->nnames)
+            return 0;
+        name = walk->names[walk->iname++];
+        len = strlen(name);
+        if (ISDIR(name))
+            len--;
+    } else {
+        do
+            ep = readdir(dir->dp);
+        while (ep && ep->d_name[0] == '.' && (!ep->d_name[1] ||
+               (ep->d_name[1] == '.' && !ep->d_name[2])));
+        if (!ep)
+            return 0;
+        name = ep->d_name;
+        len = strlen(name);
+    }
+    walk_reserve(walk, dir->len + len + 2);
+    memcpy(walk->path + dir->len, name, len);
+    walk->path[dir->len + len] = '\0';
+    walk->name = walk->path + dir->len;
+    return 1;
+}
+
+/* Move to the next entry of the walk. Directories are reported twice: with
+   WALK_DIR before their contents, unless walk_skip() is called then, and
+   with WALK_POST after them, once closed. Entries that can't be stat'ed and
+   directories that can't be read are reported with WALK_ERROR instead. */
+static WalkEvent
+walk_next(Walk *walk)
+{
+    WalkDir *dir;
+
+    if (walk->descend) {
+        walk->descend = 0;
+        if (walk_push(walk) == -1)
+            return WALK_ERROR;
+    }
+    while (walk->depth) {
+        dir = &walk->dirs[walk->depth - 1];
+        if (!dir->dp && walk_reopen(walk, dir) == -1) {
+            /* Give up on what's left of it, and on removing it. */
+            walk_close(walk, dir);
+            walk->depth--;
+            walk->fd = walk->dstfd = -1;
+            return WALK_ERROR;
+        }
+        if (!walk_read(walk, dir)) {
+            walk_close(walk, dir);
+            if (!--walk->depth)
+                return WALK_END;
+            dir--;
+            if (!dir->dp && walk_reopen(walk, dir) == -1) {
+                walk->fd = walk->dstfd = -1;
+                return WALK_ERROR;
+            }
+            walk->path[dir[1].len - 1] = '\0';
+            walk->name = walk->path + dir->len;
+            walk->fd = dirfd(dir->dp);
+            walk->dstfd = dir->dst;
+            return WALK_POST;
+        }
+        walk->fd = dirfd(dir->dp);
+        walk->dstfd = dir->dst;
+        if (!walk->stated &&
+            fstatat(walk->fd, walk->name, &walk->st, AT_SYMLINK_NOFOLLOW) == -1)
+            return WALK_ERROR;
+        if (S_ISDIR(walk->st.st_mode)) {
+            walk->descend = 1;
+            return WALK_DIR;
+        }
+        return WALK_FILE;
+    }
+    return WALK_END;
+}
+
+/* Don't enter the directory just reported by walk_next(). */
+static void
+walk_skip(Walk *walk)
+{
+    walk->descend = 0;
+}
+
+/* Whether the walk for a job must stop, because the listing it was queued
+   for is gone. */
+static int
+size_cancelled(SizeJob *job)
+{
+    int cancel;
+
+    pthread_mutex_lock(&rover.sizer.lock);
+    cancel = job->gen != rover.sizer.gen || rover.sizer.quit;
+    pthread_mutex_unlock(&rover.sizer.lock);
+    return cancel;
+}
+
+/* Insert an inode into a set, returning 0 if it was already there. */
+static int
+add_inode(Inodes *set, dev_t dev, ino_t ino)
+{
+    size_t i, n, mask;
+    Inode *old;
+
+    if (2 * (set->count + 1) > set->bulk) {
+        old = set->inodes;
+        n = set->bulk;
+        set->bulk = n ? n * 2 : 64;
+        set->inodes = calloc(set->bulk, sizeof *set->inodes);
+        set->count = 0;
+        for (i = 0; i < n; i++)
+            if (old[i].ino)
+                add_inode(set, old[i].dev, old[i].ino);
+        free(old);
+    }
+    mask = set->bulk - 1;
+    for (i = SIZE_BUCKET(dev, ino) & mask; set->inodes[i].ino;
+         i = (i + 1) & mask)
+        if (set->inodes[i].dev == dev && set->inodes[i].ino == ino)
+            return 0;
+    set->inodes[i].dev = dev;
+    set->inodes[i].ino = ino;
+    set->count++;
+    return 1;
+}
+
+/* Add up the disk usage of the contents of a directory, staying on its file
+   system and counting files with several hard links only once. */
+static off_t
+walk_size(SizeJob *job, int dirfd, dev_t dev, Inodes *seen)
+{
+    Walk walk;
+    WalkEvent event;
+    off_t total;
+    int n;
+
+    total = 0;
+    if (walk_start(&walk, dirfd, job->path, NULL, 0, NULL) == -1) {
+        walk_end(&walk);
+        return 0;
+    }
+    for (n = 1; (event = walk_next(&walk)) != WALK_END; n++) {
+        if (!(n % 256) && size_cancelled(job))
+            break;
+        if (event != WALK_FILE && event != WALK_DIR)
+            continue;
+        if (walk.st.st_nlink > 1 && event == WALK_FILE &&
+            !add_inode(seen, walk.st.st_dev, walk.st.st_ino))
+            continue;
+        total += (off_t) walk.st.st_blocks * 512;
+        if (event == WALK_DIR && walk.st.st_dev != dev)
+            walk_skip(&walk);
+    }
+    walk_end(&walk);
+    return total;
+}
+
+/* Take jobs from the queue and compute the size of their directories. */
+static void *
+size_thread(void *arg)
+{
+    Sizer *sizer = &rover.sizer;
+    SizeJob *job;
+    DirSize *entry;
+    Inodes seen;
+    struct stat statbuf;
+    off_t size;
+    int fd;
+
+    (void) arg;
+    pthread_mutex_lock(&sizer->lock);
+    while (1) {
+        while (!sizer->jobs && !sizer->quit)
+            pthread_cond_wait(&sizer->cond, &sizer->lock);
+        if (sizer->quit)
+            break;
+        job = sizer->jobs;
+        sizer->jobs = job->next;
+        if (job->gen != sizer->gen) {
+            free(job);
+            continue;
+        }
+        pthread_mutex_unlock(&sizer->lock);
+        if ((fd = open(job->path, O_RDONLY | O_DIRECTORY)) == -1 ||
+            fstat(fd, &statbuf) == -1) {
+            if (fd != -1)
+                close(fd);
+            free(job);
+            pthread_mutex_lock(&sizer->lock);
+            continue;
+        }
+        size = dir_size(statbuf.st_dev, statbuf.st_ino);
+        if (size == -1) {
+            memset(&seen, 0, sizeof seen);
+            size = (off_t) statbuf.st_blocks * 512;
+            size += walk_size(job, fd, statbuf.st_dev, &seen);
+            free(seen.inodes);
+        } else
+            close(fd);
+        pthread_mutex_lock(&sizer->lock);
+        if (job->gen != sizer->gen || sizer->quit) {
+            free(job);
+            continue;
+        }
+        if (!find_size(statbuf.st_dev, statbuf.st_ino)) {
+            entry = malloc(sizeof *entry);
+            entry->dev = statbuf.st_dev;
+            entry->ino = statbuf.st_ino;
+            entry->size = size;
+            entry->next = sizer->sizes[SIZE_BUCKET(entry->dev, entry->ino)];
+            sizer->sizes[SIZE_BUCKET(entry->dev, entry->ino)] = entry;
+        }
+        job->next = sizer->done;
+        sizer->done = job;
+    }
+    pthread_mutex_unlock(&sizer->lock);
+    return NULL;
+}
+
+/* Queue the computation of the size of a directory of the listing. The
+   walker threads are started on first use. */
+static void
+queue_size(const char *name)
+{
+    Sizer *sizer = &rover.sizer;
+    SizeJob *job;
+    size_t len;
+    int i;
+
+    pthread_mutex_lock(&sizer->lock);
+    for (i = sizer->nthreads; i < RV_SIZE_THREADS; i++)
+        if (!pthread_create(&sizer->threads[i], NULL, size_thread, NULL))
+            sizer->nthreads++;
+    len = strlen(CWD) + strlen(name) + 1;
+    job = malloc(sizeof *job + len);
+    snprintf(job->path, len, "%s%s", CWD, name);
+    if (job->path[len-2] == '/')
+        job->path[len-2] = '\0';
+    job->name = job->path + strlen(CWD);
+    job->gen = sizer->gen;
+    job->next = NULL;
+    if (sizer->jobs)
+        sizer->last->next = job;
+    else
+        sizer->jobs = job;
+    sizer->last = job;
+    pthread_cond_signal(&sizer->cond);
+    pthread_mutex_unlock(&sizer->lock);
+}
+
+/* Drop the size computations queued for the previous listing. */
+static void
+cancel_sizes()
+{
+    SizeJob *job, *next;
+
+    pthread_mutex_lock(&rover.sizer.lock);
+    rover.sizer.gen++;
+    for (job = rover.sizer.jobs; job; job = next) {
+        next = job->next;
+        free(job);
+    }
+    for (job = rover.sizer.done; job; job = next) {
+        next = job->next;
+        free(job);
+    }
+    rover.sizer.jobs = rover.sizer.done = NULL;
+    pthread_mutex_unlock(&rover.sizer.lock);
+}
+
+static void
+stop_sizes()
+{
+    int i;
+
+    cancel_sizes();
+    pthread_mutex_lock(&rover.sizer.lock);
+    rover.sizer.quit = 1;
+    pthread_cond_broadcast(&rover.sizer.cond);
+    pthread_mutex_unlock(&rover.sizer.lock);
+    for (i = 0; i < rover.sizer.nthreads; i++)
+        pthread_join(rover.sizer.threads[i], NULL);
+    forget_sizes();
+}
+
+/* Add a raw directory entry to the scan, using its type (as in d_type) to
+   avoid a stat() call whenever possible. Entries still to be stat()ed are
+   left with a null mode. */
+static void
+scan_entry(Scan *scan, const char *name, int type)
+{
+    Row *row;
+    size_t len;
+
+    if (name[0] == '.') {
+        if (!name[1] || (name[1] == '.' && !name[2]))
+            return; /* We don't want the entries "." and "..". */
+        if (!(scan->flags & SHOW_HIDDEN))
+            return;
+    }
+#ifdef DT_UNKNOWN
+    if (type == DT_DIR && !(scan->flags & SHOW_DIRS))
+        return;
+    if (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN &&
+        !(scan->flags & SHOW_FILES))
+        return;
+#endif
+    if (scan->nrows == scan->bulk) {
+        scan->bulk = scan->bulk ? scan->bulk * 2 : 64;
+        scan->rows = realloc(scan->rows, scan->bulk * sizeof *scan->rows);
+    }
+    row = &scan->rows[scan->nrows++];
+    /* Leave room for the first byte of the sort key and a trailing '/'. */
+    len = strlen(name);
+    row->name = arena_alloc(&scan->names, len + 3) + 1;
+    memcpy(row->name, name, len + 1);
+    row->key = NULL;
+    row->size = 0;
+    row->mode = 0;
+    row->islink = 0;
+    row->marked = 0;
+#ifdef DT_UNKNOWN
+    /* Unless their sizes are shown, there is nothing left to know about
+       directories. */
+    if (type == DT_DIR && !(scan->flags & SHOW_SIZES))
+        row->mode = S_IFDIR;
+    else if (type == DT_LNK)
+        row->islink = 1;
+#endif
+}
+
+/* Get metadata of a scanned entry. Symbolic links are followed, but only
+   entries that are links take a second fstatat(). */
+static int
+stat_row(int dirfd, Row *row, uint8_t flags)
+{
+    struct stat statbuf;
+
+    if (!row->islink) {
+        if (fstatat(dirfd, row->name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            return -1;
+        row->islink = S_ISLNK(statbuf.st_mode);
+    }
+    if (row->islink &&
+        fstatat(dirfd, row->name, &statbuf, 0) == -1 &&
+        fstatat(dirfd, row->name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        return -1;
+    row->mode = statbuf.st_mode;
+    if (!S_ISDIR(statbuf.st_mode))
+        row->size = statbuf.st_size;
+    else if (flags & SHOW_SIZES)
+        row->size = dir_size(statbuf.st_dev, statbuf.st_ino);
+    return 0;
+}
+
+/* Complete scanned entries: get metadata of the ones that still need it,
+   apply the view flags (dropping entries by clearing their mode) and make
+   sort keys. Directories get a trailing '/'. */
+static void
+scan_stat(void *arg, int first, int last)
+{
+    Scan *scan = arg;
+    Arena keys;
+    Row *row;
+    int i, isdir;
+    long nstat;
+    long long t;
+
+    if (scan->load && load_cancelled(scan->load))
+        return;
+    t = prof_start();
+    nstat = 0;
+    keys.blocks = NULL;
+    for (i = first; i < last; i++) {
+        row = &scan->rows[i];
+        if (!row->mode) {
+            nstat++;
+            if (stat_row(scan->dirfd, row, scan->flags) == -1) {
+                row->mode = 0; /* Entry vanished; drop it. */
+                continue;
+            }
+        }
+        isdir = S_ISDIR(row->mode);
+        if (!(scan->flags & (isdir ? SHOW_DIRS : SHOW_FILES))) {
+            row->mode = 0;
+            continue;
+        }
+        if (isdir && !row->islink)
+            strcat(row->name, "/");
+        if (scan->flags & SORT_SIZE)
+            row->key = make_size_key(&keys, row->name, isdir, row->size,
+                                     scan->bytes);
+        else if (bytecmp || scan->bytes) {
+            row->key = row->name - 1;
+            row->key[0] = isdir ? KEY_DIR : KEY_FILE;
+        } else
+            row->key = make_key(&keys, row->name, isdir, scan->bytes);
+    }
+    if (keys.blocks) {
+        pthread_mutex_lock(&scan->lock);
+        arena_move(&scan->names, &keys);
+        pthread_mutex_unlock(&scan->lock);
+    }
+    prof_end(PROF_STAT, t, nstat);
+}
+
+/* Drop entries left without mode by scan_stat(). */
+static void
+scan_filter(Scan *scan)
+{
+    int i, n;
+
+    for (i = n = 0; i < scan->nrows; i++)
+        if (scan->rows[i].mode)
+            scan->rows[n++] = scan->rows[i];
+    scan->nrows = n;
+}
+
+static int
+scan_open(Scan *scan, int dirfd, uint8_t flags)
+{
+    scan->load = NULL;
+    scan->dirfd = dirfd;
+    scan->flags = flags;
+    scan->bytes = 0;
+    scan->nrows = scan->bulk = 0;
+    scan->rows = NULL;
+    scan->names.blocks = NULL;
+    pthread_mutex_init(&scan->lock, NULL);
+#ifdef __linux__
+    scan->buf = malloc(DENTS_BUFLEN);
+#else
+    if ((dirfd = dup(dirfd)) == -1) return -1;
+    if (!(scan->dp = fdopendir(dirfd))) {
+        close(dirfd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Read the next bulk of raw entries from the scanned directory.
+   Returns 0 when the end of the directory is reached. */
+static int
+scan_read(Scan *scan)
+{
+#ifdef __linux__
+    long nread, pos;
+    struct linux_dirent64 *dent;
+    long long t;
+
+    t = prof_start();
+    nread = syscall(SYS_getdents64, scan->dirfd, scan->buf, DENTS_BUFLEN);
+    for (pos = 0; pos < nread; pos += dent->d_reclen) {
+        dent = (struct linux_dirent64 *) (scan->buf + pos);
+        scan_entry(scan, dent->d_name, dent->d_type);
+    }
+    prof_end(PROF_READDIR, t, 1);
+    return nread > 0;
+#else
+    struct dirent *ep;
+    int i;
+    long long t;
+
+    t = prof_start();
+    for (i = 0; i < LOAD_BATCH; i++) {
+        if (!(ep = readdir(scan->dp)))
+            break;
+#ifdef DT_UNKNOWN
+        scan_entry(scan, ep->d_name, ep->d_type);
+#else
+        scan_entry(scan, ep->d_name, 0);
+#endif
+    }
+    prof_end(PROF_READDIR, t, i + (i < LOAD_BATCH));
+    return i == LOAD_BATCH;
+#endif
+}
+
+static void
+scan_close(Scan *scan)
+{
+#ifdef __linux__
+    free(scan->buf);
+#else
+    closedir(scan->dp);
+#endif
+    free_rows(&scan->rows, &scan->names);
+    pthread_mutex_destroy(&scan->lock);
+}
+
+/* Open a new temporary file, already unlinked. */
+static int
+open_temp()
+{
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, PATH_MAX, "%s/rover.XXXXXX", tmpdir);
+    if ((fd = mkstemp(path)) != -1)
+        unlink(path);
+    return fd;
+}
+
+static void
+out_flush(Out *out)
+{
+    ssize_t n;
+    size_t done;
+
+    for (done = 0; done < out->len && !out->error; done += n)
+        if ((n = pwrite(out->fd, out->buf + done, out->len - done,
+                        out->pos + done)) <= 0)
+            out->error = 1;
+    out->pos += out->len;
+    out->len = 0;
+}
+
+/* Write to a region of a file. Errors are only reported by out->error. */
+static void
+out_write(Out *out, const void *data, size_t size)
+{
+    size_t n;
+
+    while (size) {
+        if (out->len == INDEX_BUFLEN)
+            out_flush(out);
+        n = MIN(size, INDEX_BUFLEN - out->len);
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        data = (const char *) data + n;
+        size -= n;
+    }
+}
+
+/* Append sorted rows to the file of runs of an index, as a new run.
+   Returns -1 if the index would get too many names. */
+static int
+write_run(Index *index, const Row *rows, int n)
+{
+    static const char pad[sizeof (off_t)];
+    RunEntry entry;
+    size_t keylen, namelen;
+    int i;
+
+    index->starts = realloc(index->starts,
+                            (index->nruns + 2) * sizeof *index->starts);
+    index->starts[index->nruns] = index->runs.pos + index->runs.len;
+    for (i = 0; i < n; i++) {
+        entry.size = rows[i].size;
+        entry.mode = rows[i].mode;
+        entry.islink = rows[i].islink;
+        entry.shared = rows[i].key + 1 == rows[i].name;
+        keylen = strlen(rows[i].key) + 1;
+        namelen = entry.shared ? 0 : strlen(rows[i].name) + 1;
+        entry.len = sizeof entry + keylen + namelen;
+        entry.len += -entry.len % sizeof pad;
+        out_write(&index->runs, &entry, sizeof entry);
+        out_write(&index->runs, rows[i].key, keylen);
+        out_write(&index->runs, rows[i].name, namelen);
+        out_write(&index->runs, pad, -(keylen + namelen) % sizeof pad);
+        index->bloblen += names_size(rows[i].name, rows[i].key);
+    }
+    index->n += n;
+    index->starts[++index->nruns] = index->runs.pos + index->runs.len;
+    return index->bloblen > UINT32_MAX ? -1 : 0;
+}
+
+/* Offsets of the regions of an index of n entries with bloblen bytes of
+   strings. Returns the length of the index. */
+static size_t
+index_layout(size_t *offs, int n, size_t bloblen)
+{
+    static const size_t widths[INDEX_COLS] = {
+        sizeof (off_t), sizeof (uint32_t), sizeof (uint32_t),
+        sizeof (uint16_t), 1, 1, 0
+    };
+    size_t pos;
+    int c;
+
+    for (pos = 0, c = 0; c < INDEX_COLS; c++) {
+        offs[c] = pos;
+        pos += c == COL_BLOB ? bloblen : n * widths[c];
+    }
+    return pos;
+}
+
+/* Runs being merged by merge_index(), in a heap by the key of their next
+   entry. Pages before done are dropped from memory. */
+typedef struct Run {
+    const char *done;
+    const char *pos;
+    const char *end;
+} Run;
+
+#define RUN_KEY(R)  ((R)->pos + sizeof (RunEntry))
+
+static void
+run_down(Run *heap, int n, int i)
+{
+    Run top = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n &&
+            strcmp(RUN_KEY(&heap[child+1]), RUN_KEY(&heap[child])) < 0)
+            child++;
+        if (strcmp(RUN_KEY(&heap[child]), RUN_KEY(&top)) >= 0)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = top;
+}
+
+/* Merge the runs of an index into its regions in a new temporary file, and
+   map it as a listing. Returns -1 on failure or cancellation. */
+static int
+merge_index(Load *load, Index *index, Listing *list)
+{
+    size_t offs[INDEX_COLS], len, runslen, keylen, namelen;
+    size_t page, drop;
+    const RunEntry *entry;
+    const char *key, *name;
+    char *runs;
+    Run *heap;
+    uint32_t off;
+    int c, fd, i, nheap, ret;
+
+    out_flush(&index->runs);
+    runslen = index->starts[index->nruns];
+    if (index->runs.error || !index->n)
+        return -1;
+    runs = mmap(NULL, runslen, PROT_READ, MAP_PRIVATE, index->runs.fd, 0);
+    if (runs == MAP_FAILED)
+        return -1;
+    page = sysconf(_SC_PAGESIZE);
+    len = index_layout(offs, index->n, index->bloblen);
+    if ((fd = open_temp()) == -1 || ftruncate(fd, len) == -1) {
+        if (fd != -1)
+            close(fd);
+        munmap(runs, runslen);
+        return -1;
+    }
+    for (c = 0; c < INDEX_COLS; c++) {
+        index->cols[c].fd = fd;
+        index->cols[c].pos = offs[c];
+    }
+    heap = malloc(index->nruns * sizeof *heap);
+    for (nheap = i = 0; i < index->nruns; i++)
+        if (index->starts[i] < index->starts[i+1]) {
+            heap[nheap].done = runs + index->starts[i] / page * page;
+            heap[nheap].pos = runs + index->starts[i];
+            heap[nheap++].end = runs + index->starts[i+1];
+        }
+    for (i = nheap / 2 - 1; i >= 0; i--)
+        run_down(heap, nheap, i);
+    /* Strings are laid out as list_put_names() does. */
+    off = 0;
+    for (i = 0; nheap; i++) {
+        if (i % INDEX_RUN == 0) {
+            if (load_cancelled(load))
+                break;
+            for (c = 0; c < nheap; c++)
+                if ((size_t) (heap[c].pos - heap[c].done) >= page) {
+                    drop = (heap[c].pos - heap[c].done) / page * page;
+                    madvise((char *) heap[c].done, drop, MADV_DONTNEED);
+                    heap[c].done += drop;
+                }
+        }
+        entry = (const RunEntry *) heap[0].pos;
+        key = RUN_KEY(&heap[0]);
+        keylen = strlen(key) + 1;
+        name = entry->shared ? key + 1 : key + keylen;
+        namelen = entry->shared ? 0 : strlen(name) + 1;
+        out_write(&index->cols[COL_SIZES], &entry->size, sizeof entry->size);
+        out_write(&index->cols[COL_MODES], &entry->mode, sizeof entry->mode);
+        out_write(&index->cols[COL_LINKS], &entry->islink, 1);
+        if (entry->shared) {
+            out_write(&index->cols[COL_KEYS], &off, sizeof off);
+            off++;
+            out_write(&index->cols[COL_NAMES], &off, sizeof off);
+            off += keylen - 1;
+            out_write(&index->cols[COL_BLOB], key, keylen);
+        } else {
+            out_write(&index->cols[COL_NAMES], &off, sizeof off);
+            off += namelen;
+            out_write(&index->cols[COL_KEYS], &off, sizeof off);
+            off += keylen;
+            out_write(&index->cols[COL_BLOB], name, namelen);
+            out_write(&index->cols[COL_BLOB], key, keylen);
+        }
+        heap[0].pos += entry->len;
+        if (heap[0].pos == heap[0].end)
+            heap[0] = heap[--nheap];
+        run_down(heap, nheap, 0);
+    }
+    free(heap);
+    munmap(runs, runslen);
+    ret = nheap ? -1 : 0;
+    for (c = 0; c < INDEX_COLS; c++) {
+        out_flush(&index->cols[c]);
+        if (index->cols[c].error)
+            ret = -1;
+    }
+    if (ret == 0) {
+        list->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (list->map == MAP_FAILED) {
+            list->map = NULL;
+            ret = -1;
+        }
+    }
+    close(fd);
+    if (ret == -1)
+        return -1;
+    list->maplen = len;
+    list->bulk = index->n;
+    list->sizes = (off_t *) (list->map + offs[COL_SIZES]);
+    list->names = (uint32_t *) (list->map + offs[COL_NAMES]);
+    list->keys = (uint32_t *) (list->map + offs[COL_KEYS]);
+    list->modes = (uint16_t *) (list->map + offs[COL_MODES]);
+    list->links = (uint8_t *) (list->map + offs[COL_LINKS]);
+    list->marks = (uint8_t *) (list->map + offs[COL_MARKS]);
+    list->blob = list->map + offs[COL_BLOB];
+    list->bloblen = list->blobbulk = index->bloblen;
+    return 0;
+}
+
+/* Hand an index to the main thread, in place of the rows published so far.
+   It's unmapped if the load was cancelled meanwhile. */
+static void
+load_publish_index(Load *load, Listing *list, int n)
+{
+    pthread_mutex_lock(&load->lock);
+    if (load->cancel) {
+        pthread_mutex_unlock(&load->lock);
+        free_listing(list);
+        return;
+    }
+    free_rows(&load->rows, &load->names);
+    load->nrows = 0;
+    load->index = *list;
+    load->nindex = n;
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->lock);
+}
+
+/* List the directory of a load again from the start, into an on-disk index.
+   Entries are stat()ed and sorted in runs of INDEX_RUN, which are merged
+   once the directory is read. Keys are in byte order, so that the listing
+   is searched by prefix as it is, without anything else in memory.
+   Returns -1 if no index could be started, with the scan left as it was to
+   go on in memory. Past that, a failure marks the load with an error. */
+static int
+ls_index(Load *load, Scan *scan)
+{
+    Index *index;
+    Listing list;
+    int more, fd, ok;
+    long long t, t_sort;
+
+    if (load_cancelled(load))
+        return 0;
+    if ((fd = open_temp()) == -1)
+        return -1;
+#ifdef __linux__
+    if (lseek(scan->dirfd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+#else
+    rewinddir(scan->dp);
+#endif
+    free_rows(&scan->rows, &scan->names);
+    scan->nrows = scan->bulk = 0;
+    scan->bytes = 1;
+    index = calloc(1, sizeof *index);
+    index->runs.fd = fd;
+    ok = 0;
+    do {
+        more = scan_read(scan);
+        if (more && scan->nrows < INDEX_RUN)
+            continue;
+        run_parallel(RV_STAT_THREADS, scan->nrows, STAT_CHUNK,
+                     scan_stat, scan);
+        if (load_cancelled(load))
+            goto done;
+        scan_filter(scan);
+        t_sort = prof_start();
+        sort_rows(scan->rows, scan->nrows);
+        prof_end(PROF_SORT, t_sort, 0);
+        if (write_run(index, scan->rows, scan->nrows) == -1)
+            goto done;
+        free_rows(&scan->rows, &scan->names);
+        scan->nrows = scan->bulk = 0;
+    } while (more);
+    t = prof_start();
+    memset(&list, 0, sizeof list);
+    if (merge_index(load, index, &list) == 0) {
+        load_publish_index(load, &list, index->n);
+        ok = 1;
+    }
+    prof_end(PROF_INDEX, t, 0);
+done:
+    if (!ok) {
+        /* The rows published so far are all the main thread gets. */
+        pthread_mutex_lock(&load->lock);
+        if (!load->cancel)
+            load->error = 1;
+        pthread_mutex_unlock(&load->lock);
+    }
+    close(index->runs.fd);
+    free(index->starts);
+    free(index);
+    return 0;
+}
+
+/* Get all entries in the directory of a load, publishing them as sorted
+   batches. Directories are read in a single pass, and the entries of each
+   batch are stat()ed in parallel. Past RV_INDEX_THRESH entries, the listing
+   goes to an on-disk index instead. */
+static void
+ls(Load *load)
+{
+    Scan scan;
+    int more, batch, total, indexed;
+    long long t, t_sort;
+
+    if (scan_open(&scan, load->dirfd, load->flags) == -1)
+        return;
+    t = prof_start();
+    scan.load = load;
+    batch = LOAD_BATCH;
+    total = 0;
+    indexed = 1;
+    do {
+        more = scan_read(&scan);
+        if (more && scan.nrows < batch)
+            continue;
+        run_parallel(RV_STAT_THREADS, scan.nrows, STAT_CHUNK,
+                     scan_stat, &scan);
+        /* Chunks skipped on cancellation are left without sort keys. */
+        if (load_cancelled(load))
+            break;
+        scan_filter(&scan);
+        if ((total += scan.nrows) > RV_INDEX_THRESH && indexed) {
+            pthread_mutex_lock(&load->lock);
+            if (load->budget)
+                load->cancel = 1; /* Not worth it for a prefetch. */
+            pthread_mutex_unlock(&load->lock);
+            if (ls_index(load, &scan) == 0)
+                break;
+            indexed = 0; /* No temporary file: keep it all in memory. */
+        }
+        t_sort = prof_start();
+        sort_rows(scan.rows, scan.nrows);
+        prof_end(PROF_SORT, t_sort, 0);
+        if (load_publish(load, scan.rows, scan.nrows, &scan.names) == -1)
+            more = 0;
+        scan.nrows = scan.bulk = 0;
+        scan.rows = NULL;
+        batch = MIN(batch * 2, LOAD_BATCH_MAX);
+    } while (more);
+    scan_close(&scan);
+    prof_end(PROF_LS, t, 0);
+}
+
+/* Whether a name matches the pattern of a find. */
+static int
+find_match(Find *find, const char *name)
+{
+    if (find->glob)
+        return !fnmatch(find->load->pattern, name, 0);
+    return strstr(name, find->load->pattern) != NULL;
+}
+
+static void *find_worker(void *arg);
+static void find_publish(Find *find, Scan *scan);
+static void find_flush(Find *find, Scan *scan);
+
+/* Queue a directory for a find to read, starting a new thread for it if
+   none is idle. Caller must hold the lock. */
+static void
+push_finddir(Find *find, const char *path, size_t len)
+{
+    FindDir *dir;
+
+    dir = malloc(sizeof *dir + len + 1);
+    memcpy(dir->path, path, len + 1);
+    dir->next = find->stack;
+    find->stack = dir;
+    if (find->waiting)
+        pthread_cond_signal(&find->cond);
+    else if (find->nthreads < RV_FIND_THREADS &&
+             !pthread_create(&find->threads[find->nthreads], NULL,
+                             find_worker, find))
+        find->nthreads++;
+}
+
+/* Count the lines of a regular file holding the text a grep looks for,
+   and add the file to the matches if there are any, with that count as its
+   size. The file is mapped and searched with memmem(). Binary files are
+   skipped. */
+static void
+grep_entry(Find *find, Scan *scan, int fd, const char *path, const char *name)
+{
+    struct stat st;
+    char *map, *p, *stop, *end, *hit;
+    off_t count;
+    int file, n;
+
+    file = openat(fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (file == -1)
+        return;
+    if (fstat(file, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size < (off_t) find->patlen || (uintmax_t) st.st_size > SIZE_MAX) {
+        close(file);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (map == MAP_FAILED)
+        return;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (st.st_size > GREP_CHUNK && scan->nrows) {
+        /* Don't keep the matches so far waiting on a long search. */
+        find_publish(find, scan);
+        clock_gettime(CLOCK_MONOTONIC, &scan->last);
+    }
+    end = map + st.st_size;
+    count = 0;
+    if (!memchr(map, '\0', MIN(st.st_size, GREP_PROBE)))
+        for (p = map; p < end && !load_cancelled(find->load); p = stop) {
+            if (end - p <= GREP_CHUNK ||
+                !(stop = memchr(p + GREP_CHUNK, '\n', end - p - GREP_CHUNK)))
+                stop = end;
+            else
+                stop++;
+            while ((hit = memmem(p, stop - p, find->load->pattern,
+                                 find->patlen))) {
+                count++;
+                if (!(p = memchr(hit, '\n', stop - hit)))
+                    break;
+                p++;
+            }
+        }
+    munmap(map, st.st_size);
+    if (!count)
+        return;
+    n = scan->nrows;
+    scan_entry(scan, path, DT_REG);
+    if (scan->nrows > n) {
+        scan->rows[n].mode = st.st_mode;
+        scan->rows[n].size = count;
+        find_flush(find, scan);
+    }
+}
+
+/* Check an entry of a directory being read by a find, whose path is in
+   path after the len bytes of the directory's. */
+static void
+find_entry(Find *find, Scan *scan, int fd, char *path, size_t len,
+           const char *name, int type)
+{
+    struct stat st;
+    size_t namelen;
+    int isdir, isreg;
+
+    if (name[0] == '.') {
+        if (!name[1] || (name[1] == '.' && !name[2]))
+            return;
+        if (!(scan->flags & SHOW_HIDDEN))
+            return;
+    }
+    namelen = strlen(name);
+    if (len + namelen + 2 > PATH_MAX)
+        return;
+    memcpy(path + len, name, namelen + 1);
+    isdir = isreg = -1;
+#ifdef DT_UNKNOWN
+    if (type != DT_UNKNOWN) {
+        isdir = type == DT_DIR;
+        isreg = type == DT_REG;
+    }
+#endif
+    if (isdir == -1) {
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            st.st_mode = 0;
+        isdir = S_ISDIR(st.st_mode);
+        isreg = S_ISREG(st.st_mode);
+#ifdef DT_UNKNOWN
+        if (isdir)
+            type = DT_DIR;
+#endif
+    }
+    if (find->load->grep) {
+        if (isreg)
+            grep_entry(find, scan, fd, path, name);
+    } else if (find_match(find, name))
+        scan_entry(scan, path, type);
+    if (isdir) {
+        path[len + namelen] = '/';
+        path[len + namelen + 1] = '\0';
+        pthread_mutex_lock(&find->lock);
+        push_finddir(find, path, len + namelen + 1);
+        pthread_mutex_unlock(&find->lock);
+    }
+}
+
+/* Read a directory for a find. Symbolic links to directories are not
+   followed. */
+static void
+find_entries(Find *find, Scan *scan, FindDir *dir)
+{
+    char path[PATH_MAX], *p;
+    size_t len;
+    int fd;
+#ifdef __linux__
+    long nread, pos;
+    struct linux_dirent64 *dent;
+#else
+    DIR *dp;
+    struct dirent *ep;
+#endif
+
+    if (!dir->path[0] && find->load->roots) {
+        /* Only the entries given, which may be directories, are searched.
+           Their types are unknown. */
+        for (p = find->load->roots; *p; p += strlen(p) + 1)
+            find_entry(find, scan, scan->dirfd, path, 0, p, 0);
+        return;
+    }
+    fd = openat(scan->dirfd, dir->path[0] ? dir->path : ".",
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    len = strlen(dir->path);
+    memcpy(path, dir->path, len + 1);
+#ifdef __linux__
+    while ((nread = syscall(SYS_getdents64, fd, scan->buf, DENTS_BUFLEN)) > 0)
+        for (pos = 0; pos < nread; pos += dent->d_reclen) {
+            dent = (struct linux_dirent64 *) (scan->buf + pos);
+            find_entry(find, scan, fd, path, len, dent->d_name, dent->d_type);
+        }
+    close(fd);
+#else
+    if (!(dp = fdopendir(fd))) {
+        close(fd);
+        return;
+    }
+    while ((ep = readdir(dp)))
+#ifdef DT_UNKNOWN
+        find_entry(find, scan, fd, path, len, ep->d_name, ep->d_type);
+#else
+        find_entry(find, scan, fd, path, len, ep->d_name, 0);
+#endif
+    closedir(dp);
+#endif
+}
+
+/* Complete the matches collected by a thread of a find, as scan_stat() does
+   for a listing, and hand them to the main thread. */
+static void
+find_publish(Find *find, Scan *scan)
+{
+    long long t;
+
+    scan_stat(scan, 0, scan->nrows);
+    if (load_cancelled(find->load)) {
+        free_rows(&scan->rows, &scan->names);
+    } else {
+        scan_filter(scan);
+        t = prof_start();
+        sort_rows(scan->rows, scan->nrows);
+        prof_end(PROF_SORT, t, 0);
+        load_publish(find->load, scan->rows, scan->nrows, &scan->names);
+        scan->rows = NULL;
+    }
+    scan->nrows = scan->bulk = 0;
+}
+
+/* Publish the matches collected by a thread of a find once there are
+   FIND_BATCH of them, or the first ones waited FIND_LATENCY milliseconds. */
+static void
+find_flush(Find *find, Scan *scan)
+{
+    struct timespec now;
+
+    if (!scan->nrows)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (scan->nrows >= FIND_BATCH ||
+        (now.tv_sec - scan->last.tv_sec) * 1000 +
+        (now.tv_nsec - scan->last.tv_nsec) / 1000000 >= FIND_LATENCY) {
+        find_publish(find, scan);
+        scan->last = now;
+    }
+}
+
+/* Take directories from the stack until it is empty and no thread may
+   push more. Matches are published in batches, and before waiting. */
+static void *
+find_worker(void *arg)
+{
+    Find *find = arg;
+    FindDir *dir;
+    Scan scan;
+
+    if (scan_open(&scan, find->load->dirfd, find->load->flags) == -1)
+        return NULL;
+    scan.load = find->load;
+    clock_gettime(CLOCK_MONOTONIC, &scan.last);
+    pthread_mutex_lock(&find->lock);
+    while (1) {
+        if (!find->stack && find->busy && scan.nrows) {
+            pthread_mutex_unlock(&find->lock);
+            find_publish(find, &scan);
+            pthread_mutex_lock(&find->lock);
+            continue;
+        }
+        while (!find->stack && find->busy) {
+            find->waiting++;
+            pthread_cond_wait(&find->cond, &find->lock);
+            find->waiting--;
+        }
+        if (!(dir = find->stack))
+            break;
+        find->stack = dir->next;
+        find->busy++;
+        pthread_mutex_unlock(&find->lock);
+        if (!load_cancelled(find->load))
+            find_entries(find, &scan, dir);
+        free(dir);
+        find_flush(find, &scan);
+        pthread_mutex_lock(&find->lock);
+        find->busy--;
+    }
+    /* Done: wake up the other threads so they notice it too. */
+    pthread_cond_broadcast(&find->cond);
+    pthread_mutex_unlock(&find->lock);
+    if (scan.nrows)
+        find_publish(find, &scan);
+    scan_close(&scan);
+    return NULL;
+}
+
+/* Find the entries under the directory of a load whose names match its
+   pattern, using up to RV_FIND_THREADS threads (including the caller).
+   A pattern with wildcards is matched as a glob, any other one as a part
+   of the names. */
+static void
+ls_find(Load *load)
+{
+    Find find;
+    long long t;
+    int i;
+
+    t = prof_start();
+    pthread_mutex_init(&find.lock, NULL);
+    pthread_cond_init(&find.cond, NULL);
+    find.nthreads = 1; /* The caller. */
+    find.waiting = 0;
+    find.busy = 0;
+    find.load = load;
+    find.glob = strpbrk(load->pattern, "*?[") != NULL;
+    find.patlen = strlen(load->pattern);
+    find.stack = calloc(1, sizeof *find.stack + 1);
+    find_worker(&find);
+    for (i = 1; i < find.nthreads; i++)
+        pthread_join(find.threads[i], NULL);
+    pthread_cond_destroy(&find.cond);
+    pthread_mutex_destroy(&find.lock);
+    prof_end(PROF_FIND, t, 0);
+}
+
+/* Open the directory of a load and get the key of its listing. */
+static int
+open_load(Load *load, const char *path)
+{
+    struct stat statbuf;
+
+    if ((load->dirfd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+        return -1;
+    if (fstat(load->dirfd, &statbuf) == 0) {
+        dir_key(&load->key, &statbuf, load->flags);
+        /* A directory changed in the last second may change again without
+           its mtime telling so on file systems with coarse timestamps. */
+        load->cacheable = statbuf.st_mtime < time(NULL) - 1;
+    }
+    return 0;
+}
+
+static void *
+load_thread(void *arg)
+{
+    Load *load = arg;
+
+    if (!load->path || open_load(load, load->path) == 0) {
+        if (load->pattern)
+            ls_find(load);
+        else
+            ls(load);
+        close(load->dirfd);
+    } else {
+        pthread_mutex_lock(&load->lock);
+        load->cancel = 1;
+        pthread_mutex_unlock(&load->lock);
+    }
+    pthread_mutex_lock(&load->lock);
+    load->done = 1;
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->lock);
+    release_load(load);
+    return NULL;
+}
+
+/* Start loading the current working directory in the background, or the
+   entries under it whose names match a pattern, or the files holding it if
+   grep is set. Roots, which is freed, limits the search to some entries. */
+static Load *
+start_load(uint8_t flags, const char *pattern, int grep, char *roots)
+{
+    Load *load;
+    pthread_t thread;
+
+    load = calloc(1, sizeof *load);
+    load->flags = flags;
+    if (open_load(load, ".") == -1) {
+        free(roots);
+        free(load);
+        return NULL;
+    }
+    if (pattern) {
+        load->pattern = strdup(pattern);
+        load->grep = grep;
+        load->roots = roots;
+        load->cacheable = 0;
+    }
+    pthread_mutex_init(&load->lock, NULL);
+    pthread_cond_init(&load->cond, NULL);
+    load->refs = 2;
+    if (pthread_create(&thread, NULL, load_thread, load))
+        load_thread(load); /* Load it in the foreground, then. */
+    else
+        pthread_detach(thread);
+    return load;
+}
+
+/* Remember a directory as listed lately, not to prefetch it again. */
+static void
+note_listed(const char *path)
+{
+    strcpy(rover.listed[rover.nlisted], path);
+    rover.nlisted = (rover.nlisted + 1) % PREFETCH_RECENT;
+}
+
+/* Start loading the listing of a directory into the cache, ahead of time.
+   Everything is left to the loader, down to opening the directory, since
+   it might be on a slow file system. */
+static void
+start_prefetch(const char *path, uint8_t flags)
+{
+    Load *load;
+    pthread_t thread;
+    int i, slot;
+
+    for (slot = -1, i = 0; i < RV_PREFETCHES; i++)
+        if (!rover.prefetches[i])
+            slot = i;
+        else if (!strcmp(rover.prefetches[i]->path, path))
+            return;
+    for (i = 0; i < PREFETCH_RECENT; i++)
+        if (!strcmp(rover.listed[i], path))
+            return;
+    if (slot == -1)
+        return;
+    load = calloc(1, sizeof *load);
+    load->path = strdup(path);
+    load->flags = flags;
+    load->budget = RV_CACHE_SIZE / 4;
+    pthread_mutex_init(&load->lock, NULL);
+    pthread_cond_init(&load->cond, NULL);
+    load->refs = 2;
+    if (pthread_create(&thread, NULL, load_thread, load)) {
+        load->refs = 1;
+        release_load(load);
+        return;
+    }
+    pthread_detach(thread);
+    rover.prefetches[slot] = load;
+    note_listed(path);
+}
+
+/* Take over the prefetch of a directory, if there's one, to load it as the
+   listing. */
+static Load *
+take_prefetch(const char *path, uint8_t flags)
+{
+    Load *load;
+    int i;
+
+    for (i = 0; i < RV_PREFETCHES; i++) {
+        load = rover.prefetches[i];
+        if (!load || strcmp(load->path, path) || load->flags != flags)
+            continue;
+        rover.prefetches[i] = NULL;
+        pthread_mutex_lock(&load->lock);
+        load->budget = 0;
+        if (load->cancel) {
+            /* It gave up already. */
+            pthread_mutex_unlock(&load->lock);
+            release_load(load);
+            return NULL;
+        }
+        pthread_mutex_unlock(&load->lock);
+        return load;
+    }
+    return NULL;
+}
+
+static void
+cancel_prefetches()
+{
+    int i;
+
+    for (i = 0; i < RV_PREFETCHES; i++)
+        if (rover.prefetches[i]) {
+            pthread_mutex_lock(&rover.prefetches[i]->lock);
+            rover.prefetches[i]->cancel = 1;
+            pthread_mutex_unlock(&rover.prefetches[i]->lock);
+            release_load(rover.prefetches[i]);
+            rover.prefetches[i] = NULL;
+        }
+}
+
+/* Stop loading the listing, without waiting for the loader thread. */
+static void
+cancel_load()
+{
+    if (!rover.load)
+        return;
+    pthread_mutex_lock(&rover.load->lock);
+    rover.load->cancel = 1;
+    pthread_mutex_unlock(&rover.load->lock);
+    release_load(rover.load);
+    rover.load = NULL;
+}
+
+/* Wait at most ms milliseconds for the listing to be completely loaded. */
+static void
+wait_load(int ms)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&rover.load->lock);
+    while (!rover.load->done &&
+           pthread_cond_timedwait(&rover.load->cond, &rover.load->lock,
+                                  &deadline) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&rover.load->lock);
+}
+
+/* Merge sorted rows into the listing, keeping the selected entry. */
+static void
+merge_listing(Row *rows, int n, Arena *names)
+{
+    Listing merged;
+    size_t size;
+    int i, j, k, sel, marking;
+
+    marking = !strcmp(CWD, rover.marks.dirpath);
+    size = 0;
+    for (j = 0; j < n; j++) {
+        rows[j].marked = marking && find_mark(&rover.marks, rows[j].name);
+        if (FLAGS & SHOW_SIZES && S_ISDIR(rows[j].mode) && rows[j].size < 0)
+            queue_size(rows[j].name);
+        size += names_size(rows[j].name, rows[j].key);
+    }
+    if (list_reserve_blob(&rover.list, size) == -1)
+        n = 0; /* Too many names to keep; leave the listing as it is. */
+    rover.gen++;
+    if (!rover.nfiles) {
+        list_reserve(&rover.list, n);
+        for (j = 0; j < n; j++)
+            list_set(&rover.list, j, &rows[j]);
+        rover.nfiles = n;
+    } else if (n) {
+        /* The merged listing takes over the blob, where there's already
+           room for the new strings. */
+        memset(&merged, 0, sizeof merged);
+        merged.blob = rover.list.blob;
+        merged.bloblen = rover.list.bloblen;
+        merged.blobbulk = rover.list.blobbulk;
+        merged.scattered = 1;
+        merged.dead = rover.list.dead;
+        list_reserve(&merged, rover.nfiles + n);
+        sel = ESEL;
+        for (i = j = k = 0; i < rover.nfiles || j < n; k++)
+            if (j == n || (i < rover.nfiles &&
+                           strcmp(EKEY(i), rows[j].key) <= 0)) {
+                if (i == ESEL)
+                    sel = k;
+                list_copy_entry(&merged, k, &rover.list, i++);
+            } else
+                list_set(&merged, k, &rows[j++]);
+        if (rover.target_esel == -1 && !rover.target[0]) {
+            /* User has moved the cursor, so stick to the selected entry. */
+            SCROLL += sel - ESEL;
+            ESEL = sel;
+        }
+        rover.list.blob = NULL;
+        free_listing(&rover.list);
+        rover.list = merged;
+        rover.nfiles += n;
+    }
+    free(rows);
+    arena_free(names);
+}
+
+static int search_exact(const char *name);
+static void try_to_sel(const char *target);
+
+/* Replace the listing with an index, keeping the selected entry. Marks and
+   sizes to compute are looked up as merge_listing() does, but the other way
+   around, so that only the pages of the index they need are read. */
+static void
+take_index(Listing *index, int n)
+{
+    char name[PATH_MAX];
+    char *entry;
+    int i, j, ndirs;
+
+    name[0] = '\0';
+    if (rover.nfiles && rover.target_esel == -1 && !rover.target[0])
+        strcpy(name, ENAME(ESEL));
+    free_listing(&rover.list);
+    rover.list = *index;
+    rover.nfiles = n;
+    rover.gen++;
+    if (name[0] && (i = search_exact(name)) != -1) {
+        SCROLL += i - ESEL;
+        ESEL = i;
+    }
+    if (!strcmp(CWD, rover.marks.dirpath))
+        for (i = 0; i < rover.marks.bulk; i++)
+            if ((entry = rover.marks.entries[i]) &&
+                (j = search_exact(entry)) != -1)
+                MARKED(j) = 1;
+    if (FLAGS & SHOW_SIZES) {
+        ndirs = row_bound((char []) {KEY_FILE, '\0'});
+        for (i = 0; i < ndirs; i++)
+            if (ESIZE(i) < 0)
+                queue_size(ENAME(i));
+    }
+}
+
+/* Take rows loaded in the background since last call into the listing.
+   Small batches are left to accumulate until the load is complete, to
+   avoid merging big listings too often. Returns 1 if the listing changed. */
+static int
+sync_load()
+{
+    Load *load = rover.load;
+    Row *rows;
+    Arena names;
+    Listing list, index;
+    int n, nindex, done;
+
+    if (!load)
+        return 0;
+    pthread_mutex_lock(&load->lock);
+    done = load->done;
+    index = load->index;
+    nindex = load->nindex;
+    if (index.map)
+        memset(&load->index, 0, sizeof load->index);
+    n = load->nrows;
+    if (!done && n * 4 < rover.nfiles)
+        n = 0;
+    rows = n ? load->rows : NULL;
+    names.blocks = NULL;
+    if (n) {
+        load->rows = NULL;
+        load->nrows = 0;
+        arena_move(&names, &load->names);
+    }
+    pthread_mutex_unlock(&load->lock);
+    if (index.map)
+        take_index(&index, nindex);
+    if (n)
+        merge_listing(rows, n, &names);
+    if (done && rover.list.scattered) {
+        /* Lay names out in listing order. */
+        copy_listing(&list, &rover.list, rover.nfiles);
+        free_listing(&rover.list);
+        rover.list = list;
+    }
+    if (done) {
+        if (load->error)
+            message(RED, "Could not list all of \"%s\".", CWD);
+        else if (load->cacheable && !load->cancel && !rover.list.map) {
+            cache_put(&load->key, &rover.list, rover.nfiles);
+            note_listed(CWD);
+        }
+        release_load(load);
+        rover.load = NULL;
+    }
+    if (rover.target[0]) {
+        try_to_sel(rover.target);
+        if (done)
+            rover.target[0] = '\0';
+    } else if (done && rover.target_esel != -1) {
+        ESEL = rover.target_esel;
+        SCROLL = rover.target_scroll;
+        rover.target_esel = -1;
+    }
+    return n || done || index.map;
+}
+
+/* Watch the current working directory for changes. */
+static void
+watch_cwd()
+{
+#ifdef __linux__
+    if (rover.inotify_fd == -1)
+        return;
+    if (rover.watch != -1)
+        inotify_rm_watch(rover.inotify_fd, rover.watch);
+    rover.watch = inotify_add_watch(rover.inotify_fd, ".",
+                                    IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                    IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+                                    IN_DELETE_SELF | IN_MOVE_SELF |
+                                    IN_ONLYDIR | IN_EXCL_UNLINK);
+#endif
+}
+
+/* Change working directory to the path in CWD. */
+static void
+cd(int reset)
+{
+    int i, esel, scroll, marking, loading = 0;
+    struct stat statbuf;
+    DirKey key;
+    Cached *cached;
+    long long t;
+
+    t = prof_start();
+    message(CYAN, "Loading \"%s\"...", CWD);
+    refresh();
+    if (chdir(CWD) == -1) {
+        getcwd(CWD, PATH_MAX-1);
+        if (CWD[strlen(CWD)-1] != '/')
+            strcat(CWD, "/");
+        goto done;
+    }
+    if (reset) ESEL = SCROLL = 0;
+    watch_cwd();
+    esel = ESEL;
+    scroll = SCROLL;
+    cancel_load();
+    cancel_sizes();
+    free_listing(&rover.list);
+    rover.nfiles = 0;
+    rover.gen++;
+    rover.target[0] = '\0';
+    rover.target_esel = -1;
+    rover.find[0] = '\0';
+    if (stat(".", &statbuf) == 0) {
+        dir_key(&key, &statbuf, FLAGS);
+        if ((cached = cache_find(&key))) {
+            copy_listing(&rover.list, &cached->list, cached->nrows);
+            rover.nfiles = cached->nrows;
+            marking = !strcmp(CWD, rover.marks.dirpath);
+            for (i = 0; i < rover.nfiles; i++) {
+                MARKED(i) = marking && find_mark(&rover.marks, ENAME(i));
+                if (FLAGS & SHOW_SIZES && S_ISDIR(EMODE(i)) && ESIZE(i) < 0)
+                    queue_size(ENAME(i));
+            }
+            goto done;
+        }
+    }
+    if ((rover.load = take_prefetch(CWD, FLAGS)) ||
+        (rover.load = start_load(FLAGS, NULL, 0, NULL))) {
+        wait_load(LOAD_WAIT);
+        loading = 1;
+    }
+done:
+    clear_message();
+    if (loading) {
+        /* Once the message line is cleared, as it may report an error. */
+        sync_load();
+        if (rover.load) {
+            /* Restore selection once the listing is complete. */
+            rover.target_esel = esel;
+            rover.target_scroll = scroll;
+        }
+    }
+    update_view();
+    prof_end(PROF_CD, t, 0);
+}
+
+/* List the entries under CWD whose names match a pattern as they are found,
+   in place of the ones in it, or with grep set the files holding it and how
+   many lines do. A grep searches only the marked entries if they are in
+   CWD. */
+static void
+find_cwd(const char *pattern, int grep)
+{
+    char *roots = NULL, *entry;
+    size_t len, used;
+    long long t;
+    int i;
+
+    t = prof_start();
+    message(CYAN, "%s \"%s\"...", grep ? "Searching" : "Finding", pattern);
+    refresh();
+    if (grep && rover.marks.nentries && !strcmp(CWD, rover.marks.dirpath)) {
+        for (i = used = 0; i < rover.marks.bulk; i++)
+            if ((entry = rover.marks.entries[i]))
+                used += strlen(entry) + 1;
+        roots = malloc(used + 1);
+        for (i = used = 0; i < rover.marks.bulk; i++) {
+            if (!(entry = rover.marks.entries[i]))
+                continue;
+            len = strlen(entry);
+            if (len > 1 && entry[len - 1] == '/')
+                len--;
+            memcpy(roots + used, entry, len);
+            roots[used + len] = '\0';
+            used += len + 1;
+        }
+        roots[used] = '\0';
+    }
+    cancel_load();
+    cancel_sizes();
+    free_listing(&rover.list);
+    rover.nfiles = 0;
+    rover.gen++;
+    rover.target[0] = '\0';
+    rover.target_esel = -1;
+    ESEL = SCROLL = 0;
+    if (pattern != rover.find)
+        strcpy(rover.find, pattern);
+    rover.grep = grep;
+    if ((rover.load = start_load(FLAGS, pattern, grep, roots))) {
+        wait_load(LOAD_WAIT);
+        sync_load();
+    }
+    clear_message();
+    update_view();
+    prof_end(PROF_CD, t, 0);
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+    return strcmp(ENAME(*(const int *) a), ENAME(*(const int *) b));
+}
+
+/* Row at position p of the search index. */
+#define PERM(P)     (rover.search.perm ? rover.search.perm[P] : (P))
+
+/* Make sure the search index matches the listing. */
+static void
+build_search()
+{
+    Search *search = &rover.search;
+    int i, n;
+
+    if (search->gen == rover.gen && search->nrows == rover.nfiles)
+        return;
+    free(search->perm);
+    free(search->tree);
+    search->perm = search->tree = NULL;
+    search->gen = rover.gen;
+    search->nrows = n = rover.nfiles;
+    search->ndirs = row_bound((char []) {KEY_FILE, '\0'});
+    search->depth = 0;
+    search->prefix[0] = '\0';
+    search->lo[0][0] = 0;
+    search->hi[0][0] = search->lo[0][1] = search->ndirs;
+    search->hi[0][1] = n;
+    if (((bytecmp || rover.list.map) && !(FLAGS & SORT_SIZE)) || !n)
+        return;
+    search->perm = malloc(n * sizeof *search->perm);
+    for (i = 0; i < n; i++)
+        search->perm[i] = i;
+    qsort(search->perm, search->ndirs, sizeof (int), namecmp);
+    qsort(search->perm + search->ndirs, n - search->ndirs, sizeof (int),
+          namecmp);
+    search->tree = malloc(2 * n * sizeof *search->tree);
+    memcpy(search->tree + n, search->perm, n * sizeof *search->tree);
+    for (i = n - 1; i > 0; i--)
+        search->tree[i] = MIN(search->tree[2*i], search->tree[2*i+1]);
+}
+
+/* Smallest row index at positions [lo, hi) of the search index. */
+static int
+search_min(int lo, int hi)
+{
+    int *tree = rover.search.tree;
+    int n = rover.search.nrows;
+    int min = rover.nfiles;
+
+    if (!tree)
+        return lo;
+    for (lo += n, hi += n; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) {
+            min = MIN(min, tree[lo]);
+            lo++;
+        }
+        if (hi & 1) {
+            hi--;
+            min = MIN(min, tree[hi]);
+        }
+    }
+    return min;
+}
+
+/* First position in [lo, hi) of the search index whose name compares to
+   the first length bytes of prefix as required (0 for >=, 1 for >). */
+static int
+search_bound(int lo, int hi, const char *prefix, int length, int above)
+{
+    int mid, cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strncmp(ENAME(PERM(mid)), prefix, length);
+        if (cmp < 0 || (above && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Narrow the search down to names starting with prefix. Only the ranges
+   of matches for the part of prefix not shared with the previous search
+   are computed, each inside the range of the prefix one byte shorter. */
+static void
+search_narrow(const char *prefix)
+{
+    Search *search = &rover.search;
+    int length, common, k, lo, hi;
+
+    build_search();
+    length = strlen(prefix);
+    for (common = 0; common < search->depth &&
+                     prefix[common] == search->prefix[common]; common++)
+        ;
+    for (search->depth = common; search->depth < length; search->depth++)
+        for (k = 0; k < 2; k++) {
+            lo = search->lo[search->depth][k];
+            hi = search->hi[search->depth][k];
+            lo = search_bound(lo, hi, prefix, search->depth + 1, 0);
+            hi = search_bound(lo, hi, prefix, search->depth + 1, 1);
+            search->lo[search->depth+1][k] = lo;
+            search->hi[search->depth+1][k] = hi;
+        }
+    strcpy(search->prefix, prefix);
+}
+
+/* Find the first entry in listing whose name starts with prefix.
+   Returns its row, or -1 if there's none. */
+static int
+search_prefix(const char *prefix)
+{
+    Search *search = &rover.search;
+    int k, length;
+
+    search_narrow(prefix);
+    length = search->depth;
+    for (k = 0; k < 2; k++)
+        if (search->lo[length][k] < search->hi[length][k])
+            return search_min(search->lo[length][k], search->hi[length][k]);
+    return -1;
+}
+
+/* Find the entry in listing with the given name. Returns its row, or -1. */
+static int
+search_exact(const char *name)
+{
+    Search *search = &rover.search;
+    int k, length, row;
+
+    search_narrow(name);
+    length = search->depth;
+    for (k = 0; k < 2; k++)
+        if (search->lo[length][k] < search->hi[length][k]) {
+            /* An exact match comes before longer names with its prefix. */
+            row = PERM(search->lo[length][k]);
+            if (!strcmp(ENAME(row), name))
+                return row;
+        }
+    return -1;
+}
+
+/* Select a target entry, if it is present. If the listing is still being
+   loaded, the target is selected again as more entries come in. */
+static void
+try_to_sel(const char *target)
+{
+    Arena keys;
+    int i;
+
+    if (rover.load && target != rover.target)
+        strcpy(rover.target, target);
+    if ((i = search_exact(target)) != -1) {
+        ESEL = i;
+        return;
+    }
+    if (FLAGS & SORT_SIZE) {
+        /* Its key would need its size: stay where we were. */
+        ESEL = MAX(MIN(ESEL, rover.nfiles - 1), 0);
+        return;
+    }
+    /* Select the closest entry that sorts after it, then. */
+    keys.blocks = NULL;
+    ESEL = MIN(row_bound(make_key(&keys, target, ISDIR(target),
+                                  rover.list.map != NULL)),
+               MAX(rover.nfiles - 1, 0));
+    arena_free(&keys);
+}
+
+/* Reload CWD, but try to keep selection. */
+static void
+reload()
+{
+    uncache_cwd();
+    forget_sizes();
+    if (rover.find[0]) {
+        strcpy(INPUT, rover.nfiles ? ENAME(ESEL) : "");
+        find_cwd(rover.find, rover.grep);
+        if (INPUT[0]) {
+            try_to_sel(INPUT);
+            update_view();
+        }
+    } else if (rover.nfiles) {
+        strcpy(INPUT, ENAME(ESEL));
+        cd(0);
+        try_to_sel(INPUT);
+        update_view();
+    } else
+        cd(1);
+}
+
+/* Reload CWD after something else may have changed it. A find or grep
+   listed is left as is, as running it again walks the whole tree: only
+   RVK_REFRESH does. */
+static void
+reload_changed()
+{
+    if (rover.find[0])
+        update_view();
+    else
+        reload();
+}
+
+/* Find the row of an entry in listing, whatever its type. */
+static int
+find_row(const char *name)
+{
+    Arena keys;
+    int i, k;
+
+    keys.blocks = NULL;
+    for (k = 0; k < 3; k++) {
+        /* Try as a file, as a directory and as a link to a directory. */
+        strcpy(BUF2, name);
+        if (k == 1)
+            strcat(BUF2, "/");
+        if (FLAGS & SORT_SIZE) {
+            /* Keys depend on sizes, so look for the name itself. */
+            for (i = 0; i < rover.nfiles && strcmp(ENAME(i), BUF2); i++)
+                ;
+            if (i < rover.nfiles)
+                break;
+            continue;
+        }
+        i = row_bound(make_key(&keys, BUF2, k, rover.list.map != NULL));
+        if (i < rover.nfiles && !strcmp(ENAME(i), BUF2))
+            break;
+    }
+    arena_free(&keys);
+    return k < 3 ? i : -1;
+}
+
+/* Bring the row of an entry up to date with the file system, inserting or
+   removing it as needed. Selection and scroll stay on the same entries.
+   The entries of an index can only be updated in place, and their sizes
+   only when not sorted by, so other changes to it wait for a reload. The
+   blob is compacted once most of it is left by removed entries. A cached
+   copy of the listing is dropped, as writes to files don't change the
+   directory's mtime that would tell it's old. */
+static void
+refresh_row(const char *name)
+{
+    Scan scan;
+    Listing list;
+    Row *row;
+    int i, selected;
+
+    uncache_cwd();
+    memset(&scan, 0, sizeof scan);
+    scan.dirfd = AT_FDCWD;
+    scan.flags = FLAGS;
+    scan.bytes = rover.list.map != NULL;
+    pthread_mutex_init(&scan.lock, NULL);
+    scan_entry(&scan, name, 0);
+    scan_stat(&scan, 0, scan.nrows);
+    scan_filter(&scan);
+    row = scan.rows;
+    if (rover.list.map) {
+        if (scan.nrows && (i = search_exact(row->name)) != -1 &&
+            EKEY(i)[0] == row->key[0]) {
+            /* A size sorted on is in the key too, which stays as it is. */
+            if (!(FLAGS & SORT_SIZE))
+                ESIZE(i) = row->size;
+            EMODE(i) = row->mode;
+            ISLINK(i) = row->islink;
+        }
+        goto done;
+    }
+    selected = 0;
+    rover.gen++;
+    if ((i = find_row(name)) != -1) {
+        rover.list.dead += names_size(ENAME(i), EKEY(i));
+        list_move(&rover.list, i, i + 1, rover.nfiles - i - 1);
+        rover.nfiles--;
+        selected = i == ESEL;
+        if (i < ESEL)
+            ESEL--;
+        ESEL = MAX(MIN(ESEL, rover.nfiles - 1), 0);
+        if (i < SCROLL)
+            SCROLL--;
+    }
+    if (scan.nrows && list_reserve_blob(&rover.list,
+                                        names_size(row->name, row->key)) == 0) {
+        row->marked = !strcmp(CWD, rover.marks.dirpath) &&
+                      find_mark(&rover.marks, row->name);
+        if (FLAGS & SHOW_SIZES && S_ISDIR(row->mode) && row->size < 0)
+            queue_size(row->name);
+        i = row_bound(row->key);
+        list_reserve(&rover.list, rover.nfiles + 1);
+        list_move(&rover.list, i + 1, i, rover.nfiles - i);
+        list_set(&rover.list, i, row);
+        rover.list.scattered = 1;
+        if (selected)
+            ESEL = i;
+        else if (rover.nfiles && i <= ESEL)
+            ESEL++;
+        if (i < SCROLL)
+            SCROLL++;
+        rover.nfiles++;
+    }
+    if (rover.list.dead > rover.list.bloblen / 2) {
+        copy_listing(&list, &rover.list, rover.nfiles);
+        free_listing(&rover.list);
+        rover.list = list;
+    }
+done:
+    free_rows(&scan.rows, &scan.names);
+    pthread_mutex_destroy(&scan.lock);
+}
+
+/* Apply changes to the watched directory since last call to the listing.
+   Events are left queued while the listing is being loaded, and a full
+   reload is done only if the queue overflowed. Since each entry is checked
+   again before updating its row, events don't need to be applied in order
+   or just once. Returns 1 if the listing changed. */
+static int
+sync_watch()
+{
+#ifdef __linux__
+    union {
+        struct inotify_event event;
+        char buf[64 * 1024];
+    } u;
+    struct inotify_event *event;
+    ssize_t len, pos;
+    int changed;
+
+    if (rover.watch == -1 || rover.load || rover.find[0])
+        return 0;
+    changed = 0;
+    while ((len = read(rover.inotify_fd, u.buf, sizeof u.buf)) > 0)
+        for (pos = 0; pos < len; pos += sizeof *event + event->len) {
+            event = (struct inotify_event *) (u.buf + pos);
+            if (event->mask & IN_Q_OVERFLOW ||
+                (event->wd == rover.watch &&
+                 event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))) {
+                /* Drain the queue; reload() gets everything anyway. */
+                while (read(rover.inotify_fd, u.buf, sizeof u.buf) > 0)
+                    ;
+                if (event->mask & IN_IGNORED)
+                    rover.watch = -1;
+                reload();
+                return 0;
+            }
+            if (event->wd != rover.watch || !event->len)
+                continue;
+            refresh_row(event->name);
+            changed = 1;
+        }
+    return changed;
+#else
+    return 0;
+#endif
+}
+
+/* Update the rows of the directories whose size was computed since last
+   call. Returns 1 if the listing changed. */
+static int
+sync_sizes()
+{
+    SizeJob *job, *next;
+
+    if (rover.load)
+        return 0;
+    pthread_mutex_lock(&rover.sizer.lock);
+    job = rover.sizer.done;
+    rover.sizer.done = NULL;
+    pthread_mutex_unlock(&rover.sizer.lock);
+    if (!job)
+        return 0;
+    for (; job; job = next) {
+        next = job->next;
+        refresh_row(job->name);
+        free(job);
+    }
+    return 1;
+}
+
+/* Keep the listing of a complete prefetch in the cache. */
+static void
+cache_prefetch(Load *load)
+{
+    Listing list;
+    size_t size;
+    int i;
+
+    if (load->cancel || !load->cacheable)
+        return;
+    memset(&list, 0, sizeof list);
+    for (size = 0, i = 0; i < load->nrows; i++)
+        size += names_size(load->rows[i].name, load->rows[i].key);
+    list_reserve(&list, load->nrows);
+    list_reserve_blob(&list, size);
+    for (i = 0; i < load->nrows; i++)
+        list_set(&list, i, &load->rows[i]);
+    cache_put(&load->key, &list, load->nrows);
+    free_listing(&list);
+}
+
+/* Cache the prefetches done since last call, and start new ones once the
+   cursor has rested on a directory for RV_PREFETCH_DELAY milliseconds:
+   that directory first, then the parent of the current one. */
+static void
+sync_prefetch()
+{
+    Load *load;
+    struct timespec now;
+    char path[PATH_MAX], *slash;
+    int i, done;
+
+    if (!RV_PREFETCH_DELAY)
+        return;
+    for (i = 0; i < RV_PREFETCHES; i++) {
+        if (!(load = rover.prefetches[i]))
+            continue;
+        pthread_mutex_lock(&load->lock);
+        done = load->done;
+        pthread_mutex_unlock(&load->lock);
+        if (!done)
+            continue;
+        cache_prefetch(load);
+        release_load(load);
+        rover.prefetches[i] = NULL;
+    }
+    if (rover.load || rover.show_jobs)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (rover.nfiles && S_ISDIR(EMODE(ESEL)))
+        /* As RVK_CD_DOWN makes it, for take_prefetch() to match. */
+        snprintf(path, PATH_MAX, "%s%s%s", CWD, ENAME(ESEL),
+                 ISLINK(ESEL) ? "/" : "");
+    else
+        strcpy(path, CWD);
+    if (strcmp(path, rover.rest.path)) {
+        strcpy(rover.rest.path, path);
+        rover.rest.since = now;
+        return;
+    }
+    if ((now.tv_sec - rover.rest.since.tv_sec) * 1000 +
+        (now.tv_nsec - rover.rest.since.tv_nsec) / 1000000 < RV_PREFETCH_DELAY)
+        return;
+    if (strcmp(path, CWD))
+        start_prefetch(path, FLAGS);
+    if (strcmp(CWD, "/")) {
+        strcpy(path, CWD);
+        path[strlen(path) - 1] = '\0';
+        if ((slash = strrchr(path, '/')))
+            slash[1] = '\0';
+        start_prefetch(path, FLAGS);
+    }
+}
+
+/* Write a size the way it's shown in listings, e.g. "1.5 M". */
+static void
+format_size(char *buf, size_t len, off_t size)
+{
+    char *suffix, *suffixes = "BKMGTPEZY";
+    off_t human_size = size * 10;
+
+    for (suffix = suffixes; human_size >= 10240; suffix++)
+        human_size = (human_size + 512) / 1024;
+    if (*suffix == 'B')
+        snprintf(buf, len, "%d %c", (int) human_size / 10, *suffix);
+    else
+        snprintf(buf, len, "%d.%d %c", (int) human_size / 10,
+                 (int) human_size % 10, *suffix);
+}
+
+static double
+elapsed(const struct timespec *since, const struct timespec *now)
+{
+    return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* Account for work done by a job. */
+static void
+job_progress(Job *job, off_t bytes, int files)
+{
+    pthread_mutex_lock(&job->lock);
+    job->bytes += bytes;
+    job->nfiles += files;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Called by a job between units of work. Blocks while the job is paused.
+   Returns -1 if it was cancelled, 0 otherwise. */
+static int
+job_check(Job *job)
+{
+    struct timespec now;
+    int cancel;
+
+    pthread_mutex_lock(&job->lock);
+    if (job->pause && !job->cancel) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job->seconds += elapsed(&job->resumed, &now);
+        job->state = JOB_PAUSED;
+        while (job->pause && !job->cancel)
+            pthread_cond_wait(&job->cond, &job->lock);
+        job->state = JOB_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &job->resumed);
+    }
+    cancel = job->cancel;
+    pthread_mutex_unlock(&job->lock);
+    return cancel ? -1 : 0;
+}
+
+/* Count a failure of a job on path (followed by name, if any), unless the
+   job was cancelled, and report it to the job's log. */
+static void
+job_error(Job *job, const char *path, const char *name, const char *reason)
+{
+    pthread_mutex_lock(&job->lock);
+    if (!job->cancel) {
+        job->nerrors++;
+        if (job->log)
+            fprintf(job->log, "rover: %s%s: %s\n", path, name ? name : "",
+                    reason);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static int
+count_cancelled(Count *count)
+{
+    int cancel;
+
+    pthread_mutex_lock(&count->lock);
+    cancel = count->cancel;
+    pthread_mutex_unlock(&count->lock);
+    return cancel;
+}
+
+/* Add up the sizes of the marked trees, reading their directories ahead
+   for the processing walk. */
+static void *
+count_thread(void *arg)
+{
+    Count *count = arg;
+    Walk walk;
+    WalkEvent event;
+    off_t total;
+    int n;
+
+    total = 0;
+    if (!walk_start(&walk, -1, count->root, count->names, count->nnames,
+                    NULL)) {
+        walk.count = count;
+        walk.ahead = 1;
+        for (n = 1; (event = walk_next(&walk)) != WALK_END; n++) {
+            if (!(n % 256) && count_cancelled(count))
+                break;
+            if (event == WALK_FILE)
+                total += walk.st.st_size;
+        }
+    }
+    walk_end(&walk);
+    pthread_mutex_lock(&count->lock);
+    count->total = total;
+    count->done = 1;
+    pthread_mutex_unlock(&count->lock);
+    return NULL;
+}
+
+/* Start counting the sizes of the given marked entries in the background. */
+static void
+start_count(Count *count, const char *dirpath, char **entries, int n)
+{
+    pthread_mutex_init(&count->lock, NULL);
+    count->cancel = 0;
+    count->done = 0;
+    count->total = 0;
+    count->root = dirpath;
+    count->names = entries;
+    count->nnames = n;
+    count->cached = 0;
+    memset(count->walked, 0, sizeof count->walked);
+    count->started = !pthread_create(&count->thread, NULL, count_thread, count);
+    if (!count->started)
+        count->done = 1;
+}
+
+static void
+finish_count(Count *count)
+{
+    Walked *walked, *next;
+    int i;
+
+    pthread_mutex_lock(&count->lock);
+    count->cancel = 1;
+    pthread_mutex_unlock(&count->lock);
+    if (count->started)
+        pthread_join(count->thread, NULL);
+    /* Listings the processing walk never got to. */
+    for (i = 0; i < COUNT_BUCKETS; i++)
+        for (walked = count->walked[i]; walked; walked = next) {
+            next = walked->next;
+            put_walked(count, walked);
+        }
+    pthread_mutex_destroy(&count->lock);
+}
+
+
+static void *delete_worker(void *arg);
+
+/* Add a directory to be listed by delete_tree(): the root, by path, or a
+   subdirectory of parent, by name. Starts another thread for subdirectories
+   if none is waiting for work. Called with the lock held. */
+static void
+push_delnode(DelTree *del, DelNode *parent, const char *name)
+{
+    DelNode *node;
+    size_t len = strlen(name);
+    size_t plen = parent ? strlen(parent->path) : 0;
+
+    if (len && name[len - 1] == '/')
+        len--;
+    node = malloc(sizeof *node + plen + len + 2);
+    if (parent)
+        memcpy(node->path, parent->path, plen);
+    memcpy(node->path + plen, name, len);
+    node->path[plen + len] = '/';
+    node->path[plen + len + 1] = '\0';
+    node->parent = parent;
+    node->pending = 1;
+    if (parent)
+        parent->pending++;
+    node->link = del->nodes;
+    del->nodes = node;
+    node->next = del->stack;
+    del->stack = node;
+    if (del->waiting)
+        pthread_cond_signal(&del->cond);
+    else if (parent && del->nthreads < RV_DELETE_THREADS &&
+             !pthread_create(&del->threads[del->nthreads], NULL,
+                             delete_worker, del))
+        del->nthreads++;
+}
+
+/* Mark a part of a directory as done, removing it and then its parents as
+   they become empty. */
+static void
+release_delnode(DelTree *del, DelNode *node)
+{
+    int pending;
+
+    for (; node; node = node->parent) {
+        pthread_mutex_lock(&del->lock);
+        pending = --node->pending;
+        pthread_mutex_unlock(&del->lock);
+        if (pending)
+            break;
+        if (remove_dir_path(node->path) < 0)
+            job_error(del->job, node->path, NULL, strerror(errno));
+    }
+}
+
+/* Delete the files of a directory, relative to its descriptor, and queue
+   its subdirectories. Each entry is stat'ed once, for its type and size. */
+static void
+delete_entries(DelTree *del, DelNode *node)
 {
+    Job *job = del->job;
     DIR *dp;
     struct dirent *ep;
-    struct stat statbuf;
-    Row *rows;
-    int i, n;
+    struct stat st;
+    int fd, n, nfiles, aborted;
+    off_t bytes;
 
-    if(!(dp = opendir("."))) return -1;
-    n = -2; /* We don't want the entries "." and "..". */
-    while (readdir(dp)) n++;
-    if (n == 0) {
-        closedir(dp);
-        return 0;
+    if (job_check(job))
+        return;
+    fd = open_dir_path(node->path, strlen(node->path), O_NOFOLLOW);
+    if (fd < 0 || !(dp = fdopendir(fd))) {
+        job_error(job, node->path, NULL, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
     }
-    rewinddir(dp);
-    rows = malloc(n * sizeof *rows);
-    i = 0;
+    aborted = 0;
+    n = nfiles = 0;
+    bytes = 0;
     while ((ep = readdir(dp))) {
         if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
             continue;
-        if (!(flags & SHOW_HIDDEN) && ep->d_name[0] == '.')
-            continue;
-        lstat(ep->d_name, &statbuf);
-        rows[i].islink = S_ISLNK(statbuf.st_mode);
-        stat(ep->d_name, &statbuf);
-        if (S_ISDIR(statbuf.st_mode)) {
-            if (flags & SHOW_DIRS) {
-                rows[i].name = malloc(strlen(ep->d_name) + 2);
-                strcpy(rows[i].name, ep->d_name);
-                if (!rows[i].islink)
-                    strcat(rows[i].name, "/");
-                rows[i].mode = statbuf.st_mode;
-                i++;
+        if (!(++n % 64)) {
+            job_progress(job, bytes, nfiles);
+            bytes = 0;
+            nfiles = 0;
+            if (job_check(job)) {
+                aborted = 1;
+                break;
             }
-        } else if (flags & SHOW_FILES) {
-            rows[i].name = malloc(strlen(ep->d_name) + 1);
-            strcpy(rows[i].name, ep->d_name);
-            rows[i].size = statbuf.st_size;
-            rows[i].mode = statbuf.st_mode;
-            i++;
+        }
+        if (fstatat(fd, ep->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            job_error(job, node->path, ep->d_name, strerror(errno));
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&del->lock);
+            push_delnode(del, node, ep->d_name);
+            pthread_mutex_unlock(&del->lock);
+        } else if (unlinkat(fd, ep->d_name, 0) < 0)
+            job_error(job, node->path, ep->d_name, strerror(errno));
+        else {
+            bytes += st.st_size;
+            nfiles++;
         }
     }
-    n = i; /* Ignore unused space in array caused by filters. */
-    qsort(rows, n, sizeof (*rows), rowcmp);
     closedir(dp);
-    *rowsp = rows;
-    return n;
+    job_progress(job, bytes, nfiles);
+    /* An unfinished directory is left in place, and so are its parents. */
+    if (!aborted)
+        release_delnode(del, node);
 }
 
-static void
-free_rows(Row **rowsp, int nfiles)
+/* Take directories from the stack until it is empty and no thread may
+   push more. */
+static void *
+delete_worker(void *arg)
 {
-    int i;
+    DelTree *del = arg;
+    DelNode *node;
 
-    for (i = 0; i < nfiles; i++)
-        free((*rowsp)[i].name);
-    free(*rowsp);
-    *rowsp = NULL;
+    pthread_mutex_lock(&del->lock);
+    while (1) {
+        while (!del->stack && del->busy) {
+            del->waiting++;
+            pthread_cond_wait(&del->cond, &del->lock);
+            del->waiting--;
+        }
+        if (!(node = del->stack))
+            break;
+        del->stack = node->next;
+        del->busy++;
+        pthread_mutex_unlock(&del->lock);
+        delete_entries(del, node);
+        pthread_mutex_lock(&del->lock);
+        del->busy--;
+    }
+    /* Done: wake up the other threads so they notice it too. */
+    pthread_cond_broadcast(&del->cond);
+    pthread_mutex_unlock(&del->lock);
+    return NULL;
 }
 
-/* Change working directory to the path in CWD. */
-static void
-cd(int reset)
+/* Delete a directory tree using up to RV_DELETE_THREADS threads (including
+   the caller). Files are removed as directories are listed; directories
+   are removed bottom-up as soon as everything in them is gone. Failures
+   are counted by the job as they happen, so this always returns 0. */
+static int
+delete_tree(Job *job, const char *path)
 {
-    int i, j;
+    DelTree del;
+    DelNode *node, *next;
+    int i;
 
-    message(CYAN, "Loading \"%s\"...", CWD);
-    refresh();
-    if (chdir(CWD) == -1) {
-        getcwd(CWD, PATH_MAX-1);
-        if (CWD[strlen(CWD)-1] != '/')
-            strcat(CWD, "/");
-        goto done;
+    pthread_mutex_init(&del.lock, NULL);
+    pthread_cond_init(&del.cond, NULL);
+    del.nthreads = 1; /* The caller. */
+    del.waiting = 0;
+    del.busy = 0;
+    del.stack = NULL;
+    del.nodes = NULL;
+    del.job = job;
+    push_delnode(&del, NULL, path);
+    delete_worker(&del);
+    for (i = 1; i < del.nthreads; i++)
+        pthread_join(del.threads[i], NULL);
+    for (node = del.nodes; node; node = next) {
+        next = node->link;
+        free(node);
     }
-    if (reset) ESEL = SCROLL = 0;
-    if (rover.nfiles)
-        free_rows(&rover.rows, rover.nfiles);
-    rover.nfiles = ls(&rover.rows, FLAGS);
-    if (!strcmp(CWD, rover.marks.dirpath)) {
-        for (i = 0; i < rover.nfiles; i++) {
-            for (j = 0; j < rover.marks.bulk; j++)
-                if (
-                    rover.marks.entries[j] &&
-                    !strcmp(rover.marks.entries[j], ENAME(i))
-                )
-                    break;
-            MARKED(i) = j < rover.marks.bulk;
-        }
-    } else
-        for (i = 0; i < rover.nfiles; i++)
-            MARKED(i) = 0;
-done:
-    clear_message();
-    update_view();
+    pthread_cond_destroy(&del.cond);
+    pthread_mutex_destroy(&del.lock);
+    return 0;
 }
 
-/* Select a target entry, if it is present. */
-static void
-try_to_sel(const char *target)
+/* Process all entries of a job, walking into directories. For each
+   directory, pre() is called before its contents and pos() after them; for
+   every other entry, proc() is called. When the job has a destination,
+   the walk follows its tree along. E.g. to move the marked entries, pre()
+   makes each directory in the destination, proc() moves files and pos()
+   removes the emptied directories. */
+static void *
+run_job(void *arg)
 {
-    ESEL = 0;
-    if (!ISDIR(target))
-        while ((ESEL+1) < rover.nfiles && S_ISDIR(EMODE(ESEL)))
-            ESEL++;
-    while ((ESEL+1) < rover.nfiles && strcoll(ENAME(ESEL), target) < 0)
-        ESEL++;
-}
+    Job *job = arg;
+    Walk walk;
+    WalkEvent event;
+    struct stat st;
+    char path[PATH_MAX];
+    const char *reason;
+    size_t len;
+    int i, n, ret;
+    long long t;
 
-/* Reload CWD, but try to keep selection. */
-static void
-reload()
-{
-    if (rover.nfiles) {
-        strcpy(INPUT, ENAME(ESEL));
-        cd(0);
-        try_to_sel(INPUT);
-        update_view();
-    } else
-        cd(1);
+    t = prof_start();
+    n = 0;
+    for (i = 0; i < job->nentries; i++)
+        if (!job->whole || job_check(job) || job->whole(job, job->entries[i]))
+            job->entries[n++] = job->entries[i];
+        else
+            job_progress(job, 0, 1);
+    /* Count and walk only what's left. */
+    start_count(&job->count, job->src, job->entries, n);
+    if (job->pre && !stat(job->dst, &st))
+        job->dirmode = st.st_mode;
+    if (walk_start(&walk, -1, job->src, job->entries, n,
+                   job->pre ? job->dst : NULL) == -1)
+        job_error(job, job->src, NULL, strerror(errno));
+    walk.count = &job->count;
+    while (walk.depth && !job_check(job) &&
+           (event = walk_next(&walk)) != WALK_END) {
+        ret = 0;
+        reason = NULL;
+        switch (event) {
+        case WALK_DIR:
+            len = strlen(walk.path);
+            if (walk.depth == 1 &&
+                !strncmp(walk.path, job->dst, len) && job->dst[len] == '/') {
+                /* The destination is inside this marked directory. */
+                walk_skip(&walk);
+                ret = -1;
+                reason = "destination is inside it";
+            } else if (walk.depth == 1 && job->tree) {
+                walk_skip(&walk);
+                snprintf(path, PATH_MAX, "%s/", walk.path);
+                ret = job->tree(job, path);
+            } else if (job->pre)
+                ret = job->pre(job, &walk);
+            break;
+        case WALK_FILE:
+            ret = job->proc(job, &walk);
+            job_progress(job, 0, 1);
+            break;
+        case WALK_POST:
+            if (job->pos)
+                ret = job->pos(job, &walk);
+            break;
+        default:
+            ret = -1;
+        }
+        if (ret)
+            job_error(job, walk.path, NULL, reason ? reason : strerror(errno));
+    }
+    walk_end(&walk);
+    pthread_mutex_lock(&job->lock);
+    pthread_mutex_lock(&job->count.lock);
+    job->total = job->count.done ? job->count.total : -1;
+    pthread_mutex_unlock(&job->count.lock);
+    job->counted = 1;
+    pthread_mutex_unlock(&job->lock);
+    finish_count(&job->count);
+    pthread_mutex_lock(&job->lock);
+    if (job->state == JOB_RUNNING) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job->seconds += elapsed(&job->resumed, &now);
+    }
+    job->state = job->cancel ? JOB_CANCELLED : job->nerrors ? JOB_FAILED :
+                 JOB_DONE;
+    pthread_mutex_unlock(&job->lock);
+    prof_end(PROF_JOB, t, 0);
+    return NULL;
 }
 
-static off_t
-count_dir(const char *path)
+/* Start queued jobs as long as there are less than RV_JOBS_MAX running. */
+static void
+start_jobs()
 {
-    DIR *dp;
-    struct dirent *ep;
-    struct stat statbuf;
-    char subpath[PATH_MAX];
-    off_t total;
+    Job *job;
+    int running = 0;
 
-    if(!(dp = opendir(path))) return 0;
-    total = 0;
-    while ((ep = readdir(dp))) {
-        if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+    for (job = rover.jobs; job; job = job->next)
+        if (job->started && !job->joined)
+            running++;
+    for (job = rover.jobs; job && running < RV_JOBS_MAX; job = job->next) {
+        if (job->started || job->state != JOB_QUEUED)
             continue;
-        snprintf(subpath, PATH_MAX, "%s%s", path, ep->d_name);
-        lstat(subpath, &statbuf);
-        if (S_ISDIR(statbuf.st_mode)) {
-            strcat(subpath, "/");
-            total += count_dir(subpath);
+        job->state = JOB_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &job->resumed);
+        if (pthread_create(&job->thread, NULL, run_job, job)) {
+            job->state = JOB_FAILED;
+            job->joined = 1;
         } else
-            total += statbuf.st_size;
+            running++;
+        job->started = 1;
     }
-    closedir(dp);
-    return total;
 }
 
-static off_t
-count_marked()
+/* Make a job for the entries marked in marks, with dst as destination. */
+static Job *
+new_job(PROCESS pre, PROCESS proc, PROCESS pos,
+        int (*whole)(Job *job, const char *name),
+        int (*tree)(Job *job, const char *path),
+        const char *msg_doing, const char *msg_done,
+        const Marks *marks, const char *dst)
+{
+    Job *job;
+    int i, n;
+
+    job = calloc(1, sizeof *job);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->state = JOB_QUEUED;
+    job->pre = pre;
+    job->proc = proc;
+    job->pos = pos;
+    job->whole = whole;
+    job->tree = tree;
+    job->msg_doing = msg_doing;
+    job->msg_done = msg_done;
+    strcpy(job->src, marks->dirpath);
+    strcpy(job->dst, dst);
+    job->entries = malloc(marks->nentries * sizeof *job->entries);
+    for (i = n = 0; i < marks->bulk; i++)
+        if (marks->entries[i])
+            job->entries[n++] = arena_strdup(&job->names, marks->entries[i],
+                                             0);
+    job->nentries = n;
+    return job;
+}
+
+/* Turn the marked entries into a job with CWD as destination, leaving
+   nothing marked. The job runs in the background. */
+static void
+queue_job(PROCESS pre, PROCESS proc, PROCESS pos,
+          int (*whole)(Job *job, const char *name),
+          int (*tree)(Job *job, const char *path),
+          const char *msg_doing, const char *msg_done)
 {
+    Job *job, **last;
     int i;
-    char *entry;
-    off_t total;
-    struct stat statbuf;
 
-    total = 0;
-    chdir(rover.marks.dirpath);
-    for (i = 0; i < rover.marks.bulk; i++) {
-        entry = rover.marks.entries[i];
-        if (entry) {
-            if (ISDIR(entry)) {
-                total += count_dir(entry);
-            } else {
-                lstat(entry, &statbuf);
-                total += statbuf.st_size;
-            }
-        }
+    job = new_job(pre, proc, pos, whole, tree, msg_doing, msg_done,
+                  &rover.marks, CWD);
+    for (last = &rover.jobs; *last; last = &(*last)->next)
+        ;
+    *last = job;
+    mark_none(&rover.marks);
+    for (i = 0; i < rover.nfiles; i++)
+        MARKED(i) = 0;
+    start_jobs();
+    update_view();
+    clear_message();
+    message(CYAN, "%s in the background.", msg_doing);
+}
+
+static void
+free_job(Job *job)
+{
+    arena_free(&job->names);
+    free(job->entries);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+static void
+pause_job(Job *job, int pause)
+{
+    pthread_mutex_lock(&job->lock);
+    job->pause = pause;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Cancel a job. Jobs that haven't started yet are finished right away. */
+static void
+cancel_job(Job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    if (!job->started) {
+        job->state = JOB_CANCELLED;
+        job->started = job->joined = 1;
     }
-    chdir(CWD);
-    return total;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
 }
 
-/* Recursively process a source directory using CWD as destination root.
-   For each node (i.e. directory), do the following:
-    1. call pre(destination);
-    2. call proc() on every child leaf (i.e. files);
-    3. recurse into every child node;
-    4. call pos(source).
-   E.g. to move directory /src/ (and all its contents) inside /dst/:
-    strcpy(CWD, "/dst/");
-    process_dir(adddir, movfile, deldir, "/src/"); */
+/* Collect the jobs that finished since last call, reporting how they went.
+   Returns 1 if the job list view needs to be updated. */
 static int
-process_dir(PROCESS pre, PROCESS proc, PROCESS pos, const char *path)
+sync_jobs()
 {
-    int ret;
-    DIR *dp;
-    struct dirent *ep;
-    struct stat statbuf;
-    char subpath[PATH_MAX];
+    Job *job;
+    int state, active = 0;
 
-    ret = 0;
-    if (pre) {
-        char dstpath[PATH_MAX];
-        strcpy(dstpath, CWD);
-        strcat(dstpath, path + strlen(rover.marks.dirpath));
-        ret |= pre(dstpath);
-    }
-    if(!(dp = opendir(path))) return -1;
-    while ((ep = readdir(dp))) {
-        if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+    for (job = rover.jobs; job; job = job->next) {
+        if (job->joined)
             continue;
-        snprintf(subpath, PATH_MAX, "%s%s", path, ep->d_name);
-        lstat(subpath, &statbuf);
-        if (S_ISDIR(statbuf.st_mode)) {
-            strcat(subpath, "/");
-            ret |= process_dir(pre, proc, pos, subpath);
-        } else
-            ret |= proc(subpath);
+        pthread_mutex_lock(&job->lock);
+        state = job->state;
+        pthread_mutex_unlock(&job->lock);
+        active = 1;
+        if (state < JOB_DONE)
+            continue;
+        pthread_join(job->thread, NULL);
+        job->joined = 1;
+        start_jobs();
+        /* Reloading clears the message line, so do it first. */
+        reload_changed();
+        if (state == JOB_DONE)
+            message(GREEN, "%s all marked entries.", job->msg_done);
+        else if (state == JOB_CANCELLED)
+            message(YELLOW, "%s cancelled.", job->msg_doing);
+        else
+            message(RED, "Some errors occured while %s.", job->msg_doing);
+        RV_ALERT();
     }
-    closedir(dp);
-    if (pos) ret |= pos(path);
-    return ret;
+    return active && rover.show_jobs;
 }
 
-/* Process all marked entries using CWD as destination root.
-   All marked entries that are directories will be recursively processed.
-   See process_dir() for details on the parameters. */
+/* Show the list of jobs with their progress in place of the listing. */
 static void
-process_marked(PROCESS pre, PROCESS proc, PROCESS pos,
-               const char *msg_doing, const char *msg_done)
+update_jobs_view()
 {
-    int i, ret;
-    char *entry;
-    char path[PATH_MAX];
+    static const char *states[] = {
+        "queued", "running", "paused", "done", "failed", "cancelled"
+    };
+    Job *job;
+    struct timespec now;
+    JobState state;
+    double seconds;
+    off_t bytes, total;
+    int i, njobs, first, nfiles, nerrors, len;
+    char size[16], speed[16];
 
-    clear_message();
-    message(CYAN, "%s...", msg_doing);
-    refresh();
-    rover.prog = (Prog) {0, count_marked(), msg_doing};
-    for (i = 0; i < rover.marks.bulk; i++) {
-        entry = rover.marks.entries[i];
-        if (entry) {
-            ret = 0;
-            snprintf(path, PATH_MAX, "%s%s", rover.marks.dirpath, entry);
-            if (ISDIR(entry)) {
-                if (!strncmp(path, CWD, strlen(path)))
-                    ret = -1;
-                else
-                    ret = process_dir(pre, proc, pos, path);
-            } else
-                ret = proc(path);
-            if (!ret) {
-                del_mark(&rover.marks, entry);
-                reload();
-            }
+    mvhline(0, 0, ' ', COLS);
+    attr_on(A_BOLD, NULL);
+    color_set(RVC_TABNUM, NULL);
+    mvaddch(0, COLS - 2, rover.tab + '0');
+    attr_off(A_BOLD, NULL);
+    color_set(RVC_CWD, NULL);
+    mvaddstr(0, 0, "Jobs");
+    wcolor_set(rover.window, RVC_BORDER, NULL);
+    wborder(rover.window, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (njobs = 0, job = rover.jobs; job; job = job->next)
+        njobs++;
+    rover.job_sel = MAX(MIN(rover.job_sel, njobs - 1), 0);
+    first = MAX(rover.job_sel - HEIGHT + 1, 0);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wcolor_set(rover.window, DEFAULT, NULL);
+    for (i = 0, job = rover.jobs; job && i < first + HEIGHT;
+         i++, job = job->next) {
+        if (i < first)
+            continue;
+        pthread_mutex_lock(&job->lock);
+        state = job->state;
+        bytes = job->bytes;
+        nfiles = job->nfiles;
+        nerrors = job->nerrors;
+        seconds = job->seconds;
+        if (state == JOB_RUNNING)
+            seconds += elapsed(&job->resumed, &now);
+        total = -1;
+        if (job->counted)
+            total = job->total;
+        else if (job->started && !job->joined) {
+            pthread_mutex_lock(&job->count.lock);
+            if (job->count.done)
+                total = job->count.total;
+            pthread_mutex_unlock(&job->count.lock);
         }
+        pthread_mutex_unlock(&job->lock);
+        /* The path is clipped; no more than a line of it is shown. */
+        snprintf(BUF1, BUFLEN, "%-9s %s %d %s %s %.*s", states[state],
+                 job->msg_doing, job->nentries,
+                 job->nentries == 1 ? "entry" : "entries",
+                 job->pre ? "to" : "in", PATH_MAX / 2,
+                 job->pre ? job->dst : job->src);
+        format_size(size, sizeof size, bytes);
+        format_size(speed, sizeof speed, seconds > 0 ? bytes / seconds : 0);
+        if (total > 0)
+            len = snprintf(BUF2, BUFLEN, "%d%% %s/s",
+                           (int) MIN(bytes * 100 / total, 100), speed);
+        else
+            len = snprintf(BUF2, BUFLEN, "%d files %s %s/s",
+                           nfiles, size, speed);
+        if (nerrors)
+            len += snprintf(BUF2 + len, BUFLEN - len, " %d errors", nerrors);
+        if (i == rover.job_sel)
+            wattr_on(rover.window, A_REVERSE, NULL);
+        mvwhline(rover.window, i - first + 1, 1, ' ', COLS - 2);
+        mbstowcs(WBUF, BUF1, PATH_MAX);
+        mvwaddnwstr(rover.window, i - first + 1, 2, WBUF,
+                    MAX(COLS - len - 6, 0));
+        mvwaddnstr(rover.window, i - first + 1, MAX(COLS - len - 2, 2), BUF2,
+                   COLS - 4);
+        if (i == rover.job_sel)
+            wattr_off(rover.window, A_REVERSE, NULL);
     }
-    rover.prog.total = 0;
-    reload();
-    if (!rover.marks.nentries)
-        message(GREEN, "%s all marked entries.", msg_done);
-    else
-        message(RED, "Some errors occured while %s.", msg_doing);
-    RV_ALERT();
+    for (i -= first; i < HEIGHT; i++)
+        mvwhline(rover.window, i + 1, 1, ' ', COLS - 2);
+    snprintf(BUF2, BUFLEN, "%d/%d", njobs ? rover.job_sel + 1 : 0, njobs);
+    strcpy(BUF1, "   ");
+    snprintf(BUF1 + 3, BUFLEN - 3, "%12.*s", BUFLEN - 4, BUF2);
+    color_set(RVC_STATUS, NULL);
+    mvaddstr(LINES - 1, STATUSPOS, BUF1);
+    wrefresh(rover.window);
 }
 
+/* Handle a key pressed on the job list. */
 static void
-update_progress(off_t delta)
+jobs_key(const char *key)
 {
-    int percent;
+    Job *job, **link;
+    int i;
 
-    if (!rover.prog.total) return;
-    rover.prog.partial += delta;
-    percent = (int) (rover.prog.partial * 100 / rover.prog.total);
-    message(CYAN, "%s...%d%%", rover.prog.msg, percent);
-    refresh();
+    for (i = 0, link = &rover.jobs; *link && i < rover.job_sel; i++)
+        link = &(*link)->next;
+    job = *link;
+    if (!strcmp(key, RVK_JOBS) || !strcmp(key, RVK_QUIT))
+        rover.show_jobs = 0;
+    else if (!strcmp(key, RVK_DOWN))
+        rover.job_sel++;
+    else if (!strcmp(key, RVK_UP))
+        rover.job_sel = MAX(rover.job_sel - 1, 0);
+    else if (!job)
+        ;
+    else if (!strcmp(key, RVK_JOB_PAUSE)) {
+        if (!job->joined)
+            pause_job(job, !job->pause);
+    } else if (!strcmp(key, RVK_JOB_CANCEL)) {
+        if (job->joined) {
+            /* Remove finished job from the list. */
+            *link = job->next;
+            free_job(job);
+        } else
+            cancel_job(job);
+    }
+    update_view();
 }
 
 /* Wrappers for file operations. */
-static int delfile(const char *path) {
+static int delfile(Job *job, Walk *walk) {
     int ret;
-    struct stat st;
 
-    ret = lstat(path, &st);
-    if (ret < 0) return ret;
-    update_progress(st.st_size);
-    return unlink(path);
+    ret = unlinkat(walk->fd, walk->name, 0);
+    if (ret == 0) job_progress(job, walk->st.st_size, 0);
+    return ret;
+}
+static int deldir(Job *job, Walk *walk) {
+    (void) job;
+    return unlinkat(walk->fd, walk->name, AT_REMOVEDIR);
 }
-static PROCESS deldir = rmdir;
 static int addfile(const char *path) {
     /* Using creat(2) because mknod(2) doesn't seem to be portable. */
     int ret;
@@ -874,62 +5291,146 @@ static int addfile(const char *path) {
     if (ret < 0) return ret;
     return close(ret);
 }
-static int cpyfile(const char *srcpath) {
+/* Copy the contents of src to dst, trying the fastest method first: cloning
+   the extents, copying inside the kernel and finally read() and write().
+   System calls made are added to calls. */
+static int
+copy_fd(Job *job, int src, int dst, off_t size, long *calls)
+{
+    ssize_t ret;
+    char *buf;
+
+#ifdef FICLONE
+    ++*calls;
+    if (!ioctl(dst, FICLONE, src)) {
+        job_progress(job, size, 0);
+        return 0;
+    }
+#endif
+#ifdef SYS_copy_file_range
+    for (++*calls; (ret = syscall(SYS_copy_file_range, src, NULL, dst, NULL,
+                                  COPY_RANGE, 0)) > 0; ++*calls) {
+        job_progress(job, ret, 0);
+        if (job_check(job))
+            return -1;
+    }
+    if (!ret)
+        return 0;
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+        errno != EOPNOTSUPP && errno != EBADF)
+        return -1;
+#endif
+#ifdef __linux__
+    for (++*calls; (ret = sendfile(dst, src, NULL, COPY_RANGE)) > 0; ++*calls) {
+        job_progress(job, ret, 0);
+        if (job_check(job))
+            return -1;
+    }
+    if (!ret)
+        return 0;
+    if (errno != ENOSYS && errno != EINVAL)
+        return -1;
+#endif
+    buf = malloc(COPY_BUFLEN);
+    for (++*calls; (ret = read(src, buf, COPY_BUFLEN)) > 0; ++*calls) {
+        ssize_t done, written;
+
+        for (done = 0; done < ret; done += written) {
+            ++*calls;
+            written = write(dst, buf + done, ret - done);
+            if (written < 0)
+                break;
+        }
+        if (done < ret || job_check(job)) {
+            ret = -1;
+            break;
+        }
+        job_progress(job, ret, 0);
+    }
+    free(buf);
+    return ret < 0 ? -1 : 0;
+}
+/* Copy the contents of src to dst, timing it when profiling. */
+static int
+copy_data(Job *job, int src, int dst, off_t size)
+{
+    long calls = 0;
+    long long t;
+    int ret;
+
+    t = prof_start();
+    ret = copy_fd(job, src, dst, size, &calls);
+    prof_end(PROF_COPY, t, calls);
+    return ret;
+}
+static int cpyfile(Job *job, Walk *walk) {
     int src, dst, ret;
-    size_t size;
-    struct stat st;
-    char buf[BUFSIZ];
-    char dstpath[PATH_MAX];
+    char target[PATH_MAX];
 
-    strcpy(dstpath, CWD);
-    strcat(dstpath, srcpath + strlen(rover.marks.dirpath));
-    ret = lstat(srcpath, &st);
-    if (ret < 0) return ret;
-    if (S_ISLNK(st.st_mode)) {
-        ret = readlink(srcpath, BUF1, BUFLEN-1);
+    if (S_ISLNK(walk->st.st_mode)) {
+        ret = readlinkat(walk->fd, walk->name, target, PATH_MAX-1);
         if (ret < 0) return ret;
-        BUF1[ret] = '\0';
-        ret = symlink(BUF1, dstpath);
+        target[ret] = '\0';
+        ret = symlinkat(target, walk->dstfd, walk->name);
     } else {
-        ret = src = open(srcpath, O_RDONLY);
-        if (ret < 0) return ret;
-        ret = dst = creat(dstpath, st.st_mode);
+        ret = src = openat(walk->fd, walk->name, O_RDONLY);
         if (ret < 0) return ret;
-        while ((size = read(src, buf, BUFSIZ)) > 0) {
-            write(dst, buf, size);
-            update_progress(size);
-            sync_signals();
+        ret = dst = openat(walk->dstfd, walk->name,
+                           O_WRONLY | O_CREAT | O_TRUNC, walk->st.st_mode);
+        if (ret < 0) {
+            close(src);
+            return ret;
         }
+        ret = copy_data(job, src, dst, walk->st.st_size);
         close(src);
-        close(dst);
-        ret = 0;
+        if (close(dst) < 0)
+            ret = -1;
     }
     return ret;
 }
-static int adddir(const char *path) {
+/* Make a directory with the same permissions as another one. */
+static int newdir(const char *path, const char *model) {
     int ret;
     struct stat st;
 
-    ret = stat(CWD, &st);
+    ret = stat(model, &st);
     if (ret < 0) return ret;
     return mkdir(path, st.st_mode);
 }
-static int movfile(const char *srcpath) {
-    int ret;
+static int adddir(Job *job, Walk *walk) {
+    return mkdirat(walk->dstfd, walk->name, job->dirmode);
+}
+/* Move a marked entry with a single rename, if it's on the same file system
+   and nothing is in the way. */
+static int movwhole(Job *job, const char *name) {
+    char srcpath[PATH_MAX], dstpath[PATH_MAX];
     struct stat st;
-    char dstpath[PATH_MAX];
 
-    strcpy(dstpath, CWD);
-    strcat(dstpath, srcpath + strlen(rover.marks.dirpath));
-    ret = rename(srcpath, dstpath);
-    if (ret == 0) {
-        ret = lstat(dstpath, &st);
-        if (ret < 0) return ret;
-        update_progress(st.st_size);
-    } else if (errno == EXDEV) {
-        ret = cpyfile(srcpath);
+    snprintf(srcpath, PATH_MAX, "%s%s", job->src, name);
+    snprintf(dstpath, PATH_MAX, "%s%s", job->dst, name);
+#if defined(SYS_renameat2) && defined(RENAME_NOREPLACE)
+    if (!syscall(SYS_renameat2, AT_FDCWD, srcpath, AT_FDCWD, dstpath,
+                 RENAME_NOREPLACE))
+        return 0;
+    if (errno != ENOSYS && errno != EINVAL)
+        return 1;
+#endif
+    /* Without RENAME_NOREPLACE, an existing destination is merged with the
+       walk; there's a window for a race, as with movfile(). */
+    if (!lstat(dstpath, &st) || errno != ENOENT)
+        return 1;
+    return rename(srcpath, dstpath) ? 1 : 0;
+}
+static int movfile(Job *job, Walk *walk) {
+    int ret;
+
+    ret = renameat(walk->fd, walk->name, walk->dstfd, walk->name);
+    if (ret == 0)
+        job_progress(job, walk->st.st_size, 0);
+    else if (errno == EXDEV) {
+        ret = cpyfile(job, walk);
         if (ret < 0) return ret;
-        ret = unlink(srcpath);
+        ret = unlinkat(walk->fd, walk->name, 0);
     }
     return ret;
 }
@@ -1025,11 +5526,192 @@ update_input(const char *prompt, Color color)
     move(LINES - 1, plen + rover.edit.left - rover.edit_scroll);
 }
 
+/* Run a batch job to completion, printing its progress every second.
+   Returns the number of errors, or -1 if it could not be started. */
+static int
+run_batch_job(Job *job)
+{
+    struct timespec now, pause = {0, 100000000};
+    double seconds;
+    off_t bytes, total;
+    int i, nfiles, nerrors;
+    JobState state;
+    char size[16], speed[16];
+
+    job->log = stderr;
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->resumed);
+    if (pthread_create(&job->thread, NULL, run_job, job))
+        return -1;
+    for (i = 1; ; i++) {
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&job->lock);
+        state = job->state;
+        bytes = job->bytes;
+        nfiles = job->nfiles;
+        nerrors = job->nerrors;
+        seconds = job->seconds;
+        if (state == JOB_RUNNING)
+            seconds += elapsed(&job->resumed, &now);
+        total = -1;
+        if (job->counted)
+            total = job->total;
+        else {
+            pthread_mutex_lock(&job->count.lock);
+            if (job->count.done)
+                total = job->count.total;
+            pthread_mutex_unlock(&job->count.lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+        format_size(size, sizeof size, bytes);
+        format_size(speed, sizeof speed, seconds > 0 ? bytes / seconds : 0);
+        if (state >= JOB_DONE)
+            break;
+        if (i % 10)
+            continue;
+        printf("%s: %d files, %s, %s/s", job->msg_doing, nfiles, size, speed);
+        if (total > 0)
+            printf(", %d%%", (int) MIN(bytes * 100 / total, 100));
+        if (nerrors)
+            printf(", %d errors", nerrors);
+        printf("\n");
+        fflush(stdout);
+    }
+    pthread_join(job->thread, NULL);
+    printf("%s %d files, %s, from %s in %.1f s, %d errors.\n", job->msg_done,
+           nfiles, size, job->src, seconds, nerrors);
+    fflush(stdout);
+    return nerrors;
+}
+
+/* Delete, copy or move the entries listed in a file (one path per line, as
+   written by --save-marks), without the interface. Entries are grouped by
+   directory, each group making a job that runs like a marked one. */
+static int
+batch(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        PROCESS pre, proc, pos;
+        int (*whole)(Job *job, const char *name);
+        int (*tree)(Job *job, const char *path);
+        const char *msg_doing, *msg_done;
+    } ops[] = {
+        {"delete", NULL, delfile, deldir, NULL, delete_tree,
+         "Deleting", "Deleted"},
+        {"copy", adddir, cpyfile, NULL, NULL, NULL, "Copying", "Copied"},
+        {"move", adddir, movfile, deldir, movwhole, NULL, "Moving", "Moved"}
+    };
+    char line[PATH_MAX], path[PATH_MAX + 2], cwd[PATH_MAX], dst[PATH_MAX];
+    char *name;
+    const char *marks_path = "-";
+    FILE *fp;
+    Marks marks;
+    Job *job;
+    struct stat st;
+    size_t len;
+    int op, status;
+
+    setlocale(LC_ALL, "");
+    for (op = 0; op < 3 && argc && strcmp(argv[0], ops[op].name); op++)
+        ;
+    if (argc > 2 && !strcmp(argv[1], "--marks")) {
+        marks_path = argv[2];
+        argv[2] = argv[0];
+        argc -= 2; argv += 2;
+    }
+    if (op == 3 || argc != (ops[op].pre ? 2 : 1)) {
+        fprintf(stderr, "Usage: rover --batch delete|copy|move "
+                "[--marks FILE] [DEST]\n");
+        return 2;
+    }
+    if (ops[op].pre) {
+        if (!realpath(argv[1], dst) || stat(dst, &st) || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "rover: %s: not a directory\n", argv[1]);
+            return 2;
+        }
+        if (dst[strlen(dst) - 1] != '/')
+            strcat(dst, "/");
+    }
+    if (!strcmp(marks_path, "-"))
+        fp = stdin;
+    else if (!(fp = fopen(marks_path, "r"))) {
+        fprintf(stderr, "rover: %s: %s\n", marks_path, strerror(errno));
+        return 2;
+    }
+    if (!getcwd(cwd, PATH_MAX))
+        strcpy(cwd, "/");
+    init_marks(&marks);
+    status = 0;
+    while (1) {
+        name = NULL;
+        if (fgets(line, sizeof line, fp)) {
+            len = strcspn(line, "\n");
+            line[len] = '\0';
+            if (!len)
+                continue;
+            if (line[0] == '/')
+                strcpy(path, line);
+            else if (snprintf(path, PATH_MAX, "%s/%s", cwd, line) >= PATH_MAX) {
+                fprintf(stderr, "rover: %s: path too long\n", line);
+                status = 1;
+                continue;
+            }
+            for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--)
+                path[len - 1] = '\0';
+            name = strrchr(path, '/') + 1;
+            if (!*name || !strcmp(name, ".") || !strcmp(name, "..")) {
+                fprintf(stderr, "rover: %s: cannot be processed\n", line);
+                status = 1;
+                continue;
+            }
+            if (lstat(path, &st)) {
+                fprintf(stderr, "rover: %s: %s\n", line, strerror(errno));
+                status = 1;
+                continue;
+            }
+            if (S_ISDIR(st.st_mode))
+                strcat(name, "/");
+        }
+        /* Marks are kept for a single directory; run them when it changes
+           and when the list is over. */
+        if (marks.nentries && (!name || strncmp(path, marks.dirpath,
+                                                name - path) ||
+                               marks.dirpath[name - path])) {
+            if (ops[op].pre && !strcmp(marks.dirpath, dst)) {
+                fprintf(stderr, "rover: %s: source and destination are the "
+                        "same\n", marks.dirpath);
+                status = 1;
+            } else {
+                job = new_job(ops[op].pre, ops[op].proc, ops[op].pos,
+                              ops[op].whole, ops[op].tree, ops[op].msg_doing,
+                              ops[op].msg_done, &marks,
+                              ops[op].pre ? dst : marks.dirpath);
+                if (run_batch_job(job))
+                    status = 1;
+                free_job(job);
+            }
+            mark_none(&marks);
+        }
+        if (!name)
+            break;
+        memcpy(line, path, name - path);
+        line[name - path] = '\0';
+        add_mark(&marks, line, name);
+    }
+    if (fp != stdin)
+        fclose(fp);
+    free_marks(&marks);
+    return status;
+}
+
 int
 main(int argc, char *argv[])
 {
     int i, ch;
     char *program;
+    char *collate;
     char *entry;
     const char *key;
     const char *clip_path;
@@ -1038,11 +5720,14 @@ main(int argc, char *argv[])
     FILE *save_cwd_file = NULL;
     FILE *save_marks_file = NULL;
     FILE *clip_file;
+    Job *job;
 
     if (argc >= 2) {
         if (!strcmp(argv[1], "-v") || !strcmp(argv[1], "--version")) {
             printf("rover %s\n", RV_VERSION);
             return 0;
+        } else if (!strcmp(argv[1], "--batch")) {
+            return batch(argc - 2, argv + 2);
         } else if (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
             printf(
                 "Usage: rover [OPTIONS] [DIR [DIR [...]]]\n"
@@ -1051,6 +5736,9 @@ main(int argc, char *argv[])
                 "       Print this help message and exit.\n\n"
                 "  or:  rover -v|--version\n"
                 "       Print program version and exit.\n\n"
+                "  or:  rover --batch delete|copy|move [--marks FILE] [DEST]\n"
+                "       Process the entries listed in FILE (or standard input)\n"
+                "       without the interface.\n\n"
                 "See rover(1) for more information.\n"
                 "Rover homepage: <https://github.com/lecram/rover>.\n"
             );
@@ -1074,7 +5762,13 @@ main(int argc, char *argv[])
         }
     }
     get_user_programs();
+    init_profile();
     init_term();
+    collate = setlocale(LC_COLLATE, NULL);
+    bytecmp = !strcmp(collate, "C") || !strcmp(collate, "POSIX") ||
+              !strncmp(collate, "C.", 2);
+    if (getenv("TMPDIR") && *getenv("TMPDIR"))
+        tmpdir = getenv("TMPDIR");
     rover.nfiles = 0;
     for (i = 0; i < 10; i++) {
         rover.tabs[i].esel = rover.tabs[i].scroll = 0;
@@ -1095,7 +5789,17 @@ main(int argc, char *argv[])
         if (rover.tabs[i].cwd[strlen(rover.tabs[i].cwd) - 1] != '/')
             strcat(rover.tabs[i].cwd, "/");
     rover.tab = 1;
+    rover.target_esel = -1;
+#ifdef __linux__
+    rover.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    rover.inotify_fd = -1;
+#endif
+    rover.watch = -1;
+    pthread_mutex_init(&rover.sizer.lock, NULL);
+    pthread_cond_init(&rover.sizer.cond, NULL);
     rover.window = subwin(stdscr, LINES - 2, COLS, 1, 0);
+    idlok(rover.window, TRUE);
     init_marks(&rover.marks);
     cd(1);
     strcpy(CLIPBOARD, CWD);
@@ -1105,8 +5809,33 @@ main(int argc, char *argv[])
         ch = rover_getch();
         key = keyname(ch);
         clear_message();
-        if (!strcmp(key, RVK_QUIT)) break;
-        else if (ch >= '0' && ch <= '9') {
+        /* A selection pending on a listing still being loaded is dropped as
+           soon as the user does anything else. */
+        rover.target[0] = '\0';
+        rover.target_esel = -1;
+        if (rover.show_jobs) {
+            jobs_key(key);
+            continue;
+        }
+        if (!strcmp(key, RVK_QUIT)) {
+            for (job = rover.jobs; job && job->joined; job = job->next)
+                ;
+            if (!job)
+                break;
+            message(YELLOW, "Cancel all jobs and quit? (Y/n)");
+            if (rover_getch() == 'Y')
+                break;
+            clear_message();
+        } else if (!strcmp(key, RVK_JOBS)) {
+            rover.show_jobs = 1;
+            update_view();
+        } else if (!strcmp(key, RVK_TG_PROFILE)) {
+            if (profile.path) {
+                profile.overlay = !profile.overlay;
+                update_view();
+            } else
+                message(RED, "Set ROVER_PROFILE to a file to enable profiling.");
+        } else if (ch >= '0' && ch <= '9') {
             rover.tab = ch - '0';
             cd(0);
         } else if (!strcmp(key, RVK_HELP)) {
@@ -1114,30 +5843,30 @@ main(int argc, char *argv[])
         } else if (!strcmp(key, RVK_DOWN)) {
             if (!rover.nfiles) continue;
             ESEL = MIN(ESEL + 1, rover.nfiles - 1);
-            update_view();
+            update_cursor();
         } else if (!strcmp(key, RVK_UP)) {
             if (!rover.nfiles) continue;
             ESEL = MAX(ESEL - 1, 0);
-            update_view();
+            update_cursor();
         } else if (!strcmp(key, RVK_JUMP_DOWN)) {
             if (!rover.nfiles) continue;
             ESEL = MIN(ESEL + RV_JUMP, rover.nfiles - 1);
             if (rover.nfiles > HEIGHT)
                 SCROLL = MIN(SCROLL + RV_JUMP, rover.nfiles - HEIGHT);
-            update_view();
+            update_cursor();
         } else if (!strcmp(key, RVK_JUMP_UP)) {
             if (!rover.nfiles) continue;
             ESEL = MAX(ESEL - RV_JUMP, 0);
             SCROLL = MAX(SCROLL - RV_JUMP, 0);
-            update_view();
+            update_cursor();
         } else if (!strcmp(key, RVK_JUMP_TOP)) {
             if (!rover.nfiles) continue;
             ESEL = 0;
-            update_view();
+            update_cursor();
         } else if (!strcmp(key, RVK_JUMP_BOTTOM)) {
             if (!rover.nfiles) continue;
             ESEL = rover.nfiles - 1;
-            update_view();
+            update_cursor();
         } else if (!strcmp(key, RVK_CD_DOWN)) {
             if (!rover.nfiles || !S_ISDIR(EMODE(ESEL))) continue;
             if (chdir(ENAME(ESEL)) == -1) {
@@ -1145,9 +5874,16 @@ main(int argc, char *argv[])
                 continue;
             }
             strcat(CWD, ENAME(ESEL));
+            if (ISLINK(ESEL))
+                strcat(CWD, "/");
             cd(1);
         } else if (!strcmp(key, RVK_CD_UP)) {
             char *dirname, first;
+            if (rover.find[0]) {
+                /* Back to the listing the find was made from. */
+                cd(1);
+                continue;
+            }
             if (!strcmp(CWD, "/")) continue;
             CWD[strlen(CWD) - 1] = '\0';
             dirname = strrchr(CWD, '/') + 1;
@@ -1168,8 +5904,11 @@ main(int argc, char *argv[])
             cd(1);
         } else if (!strcmp(key, RVK_TARGET)) {
             char *bname, first;
-            int is_dir = S_ISDIR(EMODE(ESEL));
-            ssize_t len = readlink(ENAME(ESEL), BUF1, BUFLEN-1);
+            int is_dir;
+            ssize_t len;
+            if (!rover.nfiles) continue;
+            is_dir = S_ISDIR(EMODE(ESEL));
+            len = readlink(ENAME(ESEL), BUF1, BUFLEN-1);
             if (len == -1) continue;
             BUF1[len] = '\0';
             if (access(BUF1, F_OK) == -1) {
@@ -1203,6 +5942,7 @@ main(int argc, char *argv[])
             *bname = '\0';
             update_view();
         } else if (!strcmp(key, RVK_COPY_PATH)) {
+            if (!rover.nfiles) continue;
             clip_path = getenv("CLIP");
             if (!clip_path) goto copy_path_fail;
             clip_file = fopen(clip_path, "w");
@@ -1241,20 +5981,20 @@ paste_path_fail:
 #else
                 spawn((char *[]) {program, NULL});
 #endif
-                reload();
+                reload_changed();
             }
         } else if (!strcmp(key, RVK_VIEW)) {
             if (!rover.nfiles || S_ISDIR(EMODE(ESEL))) continue;
             if (open_with_env(user_pager, ENAME(ESEL)))
-                cd(0);
+                reload_changed();
         } else if (!strcmp(key, RVK_EDIT)) {
             if (!rover.nfiles || S_ISDIR(EMODE(ESEL))) continue;
             if (open_with_env(user_editor, ENAME(ESEL)))
-                cd(0);
+                reload_changed();
         } else if (!strcmp(key, RVK_OPEN)) {
             if (!rover.nfiles || S_ISDIR(EMODE(ESEL))) continue;
             if (open_with_env(user_open, ENAME(ESEL)))
-                cd(0);
+                reload_changed();
         } else if (!strcmp(key, RVK_SEARCH)) {
             int oldsel, oldscroll, length;
             if (!rover.nfiles) continue;
@@ -1267,10 +6007,7 @@ paste_path_fail:
                 Color color = RED;
                 length = strlen(INPUT);
                 if (length) {
-                    for (sel = 0; sel < rover.nfiles; sel++)
-                        if (!strncmp(ENAME(sel), INPUT, length))
-                            break;
-                    if (sel < rover.nfiles) {
+                    if ((sel = search_prefix(INPUT)) != -1) {
                         color = GREEN;
                         ESEL = sel;
                         if (rover.nfiles > HEIGHT) {
@@ -1295,6 +6032,23 @@ paste_path_fail:
             }
             clear_message();
             update_view();
+        } else if (!strcmp(key, RVK_FIND) || !strcmp(key, RVK_GREP)) {
+            int grep = !strcmp(key, RVK_GREP);
+            char *prompt = grep ? RVP_GREP : RVP_FIND;
+            if (rover.find[0] && rover.load) {
+                cancel_load();
+                update_view();
+                message(YELLOW, "Stopped %s \"%s\".",
+                        rover.grep ? "searching" : "finding", rover.find);
+                continue;
+            }
+            start_line_edit(rover.grep == grep ? rover.find : "");
+            update_input(prompt, INPUT[0] ? GREEN : RED);
+            while ((edit_stat = get_line_edit()) == CONTINUE)
+                update_input(prompt, INPUT[0] ? GREEN : RED);
+            clear_message();
+            if (edit_stat == CONFIRM && INPUT[0])
+                find_cwd(INPUT, grep);
         } else if (!strcmp(key, RVK_TG_FILES)) {
             FLAGS ^= SHOW_FILES;
             reload();
@@ -1304,6 +6058,12 @@ paste_path_fail:
         } else if (!strcmp(key, RVK_TG_HIDDEN)) {
             FLAGS ^= SHOW_HIDDEN;
             reload();
+        } else if (!strcmp(key, RVK_TG_SIZES)) {
+            FLAGS ^= SHOW_SIZES;
+            reload();
+        } else if (!strcmp(key, RVK_TG_SORT)) {
+            FLAGS ^= SORT_SIZE;
+            reload();
         } else if (!strcmp(key, RVK_NEW_FILE)) {
             int ok = 0;
             start_line_edit("");
@@ -1357,7 +6117,7 @@ paste_path_fail:
             clear_message();
             if (edit_stat == CONFIRM) {
                 if (ok) {
-                    if (adddir(INPUT) == 0) {
+                    if (newdir(INPUT, CWD) == 0) {
                         cd(1);
                         strcat(INPUT, "/");
                         try_to_sel(INPUT);
@@ -1371,6 +6131,7 @@ paste_path_fail:
             int ok = 0;
             char *last;
             int isdir;
+            if (!rover.nfiles) continue;
             strcpy(INPUT, ENAME(ESEL));
             last = INPUT + strlen(INPUT) - 1;
             if ((isdir = *last == '/'))
@@ -1423,7 +6184,7 @@ paste_path_fail:
                 message(YELLOW, "Delete \"%s\"? (Y/n)", ENAME(ESEL));
                 if (rover_getch() == 'Y') {
                     const char *name = ENAME(ESEL);
-                    int ret = ISDIR(ENAME(ESEL)) ? deldir(name) : delfile(name);
+                    int ret = ISDIR(ENAME(ESEL)) ? rmdir(name) : unlink(name);
                     reload();
                     if (ret)
                         message(RED, "Could not delete \"%s\".", ENAME(ESEL));
@@ -1432,6 +6193,7 @@ paste_path_fail:
             } else
                   message(RED, "No entry selected for deletion.");
         } else if (!strcmp(key, RVK_TG_MARK)) {
+            if (!rover.nfiles) continue;
             if (MARKED(ESEL))
                 del_mark(&rover.marks, ENAME(ESEL));
             else
@@ -1459,7 +6221,8 @@ paste_path_fail:
             if (rover.marks.nentries) {
                 message(YELLOW, "Delete all marked entries? (Y/n)");
                 if (rover_getch() == 'Y')
-                    process_marked(NULL, delfile, deldir, "Deleting", "Deleted");
+                    queue_job(NULL, delfile, deldir, NULL, delete_tree,
+                              "Deleting", "Deleted");
                 else
                     clear_message();
             } else
@@ -1467,7 +6230,8 @@ paste_path_fail:
         } else if (!strcmp(key, RVK_MARK_COPY)) {
             if (rover.marks.nentries) {
                 if (strcmp(CWD, rover.marks.dirpath))
-                    process_marked(adddir, cpyfile, NULL, "Copying", "Copied");
+                    queue_job(adddir, cpyfile, NULL, NULL, NULL,
+                              "Copying", "Copied");
                 else
                     message(RED, "Cannot copy to the same path.");
             } else
@@ -1475,15 +6239,26 @@ paste_path_fail:
         } else if (!strcmp(key, RVK_MARK_MOVE)) {
             if (rover.marks.nentries) {
                 if (strcmp(CWD, rover.marks.dirpath))
-                    process_marked(adddir, movfile, deldir, "Moving", "Moved");
+                    queue_job(adddir, movfile, deldir, movwhole, NULL,
+                              "Moving", "Moved");
                 else
                     message(RED, "Cannot move to the same path.");
             } else
                 message(RED, "No entries marked for moving.");
         }
     }
-    if (rover.nfiles)
-        free_rows(&rover.rows, rover.nfiles);
+    while ((job = rover.jobs)) {
+        rover.jobs = job->next;
+        cancel_job(job);
+        if (!job->joined)
+            pthread_join(job->thread, NULL);
+        free_job(job);
+    }
+    cancel_load();
+    cancel_prefetches();
+    stop_sizes();
+    write_profile();
+    free_listing(&rover.list);
     delwin(rover.window);
     if (save_cwd_file != NULL) {
         fputs(CWD, save_cwd_file);
@@ -1498,5 +6273,9 @@ paste_path_fail:
         fclose(save_marks_file);
     }
     free_marks(&rover.marks);
+    free(rover.search.perm);
+    free(rover.search.tree);
+    while (rover.cache)
+        cache_drop(rover.cache);
     return 0;
 }